@@ -15,6 +15,7 @@
 #define RAM_SIZE (RAM_PAGES * PAGESIZE)
 #define SWAP_PAGES (128)
 #define SWAP_SIZE (SWAP_PAGES * PAGESIZE)
+#define VIRT_SIZE (NPAGES * PAGESIZE)
 #undef DEBUG
 
 #define ADD (0)
@@ -36,6 +37,22 @@
 #define HALT (16)
 
 #define TRACE_SIZE (10000)
+#ifndef TLB_SIZE
+#define TLB_SIZE (4)   /* Default number of TLB entries, see --tlb. */
+#endif
+#define TLB_MAX (64)
+#define TRACE_BUFSIZE (1 << 20)
+
+/*
+ * How much run() prints about every instruction it executes:
+ *   TRACE_NONE       nothing, only the registers and statistics at the end
+ *   TRACE_INSTR      its pc and mnemonic (the default)
+ *   TRACE_REGISTERS  also all registers after it
+ * Compiling with -DNO_TRACE leaves the tracing out of run() altogether.
+ */
+#define TRACE_NONE (0)
+#define TRACE_INSTR (1)
+#define TRACE_REGISTERS (2)
 
 char *mnemonics[] = {
     [ADD] = "add",   [ADDI] = "addi", [SUB] = "sub", [SUBI] = "subi",
@@ -59,6 +76,23 @@ typedef struct {
   unsigned int readonly : 1;   /* Error if written to (not checked). */
 } page_table_entry_t;
 
+/* An instruction, decoded once instead of every time it is executed. */
+typedef struct {
+  unsigned opcode;
+  unsigned dest_reg;
+  unsigned source_reg1;
+  int constant;
+  bool valid;          /* Decoded from what is in memory at its address. */
+  const void *handler; /* Code executing it, see run(). */
+} decoded_t;
+
+/* A translation cached in the TLB. */
+typedef struct {
+  unsigned virt_page;
+  unsigned phys_page;
+  bool modified; /* Page table entry is marked modified already. */
+} tlb_entry_t;
+
 typedef struct {
   page_table_entry_t *owner; /* Owner of this phys page. */
   unsigned page;             /* Swap page of page if assigned. */
@@ -68,13 +102,24 @@ static unsigned long long num_memoryaccesses; /* Statistics. */
 static unsigned long long num_pagefault;      /* Statistics. */
 static unsigned long long num_diskwrites;     /* Statistics. */
 static unsigned long long num_diskreads;      /* Statistics. */
+static unsigned long long num_tlbhits;        /* Statistics. */
+static unsigned long long num_tlbmisses;      /* Statistics. */
 static page_table_entry_t page_table[NPAGES]; /* OS data structure. */
 static coremap_entry_t coremap[RAM_PAGES];    /* OS data structure. */
 static unsigned memory[RAM_SIZE];             /* Hardware: RAM. */
 static unsigned swap[SWAP_SIZE];              /* Hardware: disk. */
 static unsigned (*replace)(void);             /* Page repl. alg. */
+#ifdef NO_TRACE
+#define trace_level TRACE_NONE
+#else
+static int trace_level = TRACE_INSTR;         /* See TRACE_NONE. */
+#endif
 
 static unsigned page_accesses[TRACE_SIZE];    /* Collecting to optimal replacement. */
+static decoded_t decoded[VIRT_SIZE];          /* Instructions, decoded once. */
+static tlb_entry_t tlb[TLB_MAX];              /* Most recently used first. */
+static int tlb_size = TLB_SIZE;               /* Entries of the TLB. */
+static int tlb_count;                         /* Entries in use. */
 
 unsigned make_instr(unsigned opcode, unsigned dest, unsigned s1, unsigned s2) {
   return (opcode << 26) | (dest << 21) | (s1 << 16) | (s2 & 0xffff);
@@ -88,6 +133,14 @@ unsigned extract_source1(unsigned instr) { return (instr >> 16) & 0x1f; }
 
 signed extract_constant(unsigned instr) { return (short)(instr & 0xffff); }
 
+void decode(decoded_t *in, unsigned instr) {
+  in->opcode = extract_opcode(instr);
+  in->dest_reg = extract_dest(instr);
+  in->source_reg1 = extract_source1(instr);
+  in->constant = extract_constant(instr);
+  in->valid = true;
+}
+
 void error(char *fmt, ...) {
   va_list ap;
   char buf[BUFSIZ];
@@ -98,6 +151,52 @@ void error(char *fmt, ...) {
   exit(1);
 }
 
+/*
+ * The TLB is fully associative and replaces the least recently used
+ * translation. It caches the page table entry as translate() left it, so
+ * whatever changes the entry otherwise has to drop it from the TLB.
+ */
+static tlb_entry_t *tlb_lookup(unsigned virt_page) {
+  tlb_entry_t found;
+
+  for (int i = 0; i < tlb_count; ++i) {
+    if (tlb[i].virt_page == virt_page) {
+      found = tlb[i];
+      memmove(&tlb[1], &tlb[0], i * sizeof tlb[0]);
+      tlb[0] = found;
+      return &tlb[0];
+    }
+  }
+  return NULL;
+}
+
+static void tlb_insert(unsigned virt_page, unsigned phys_page, bool modified) {
+  if (tlb_size == 0)
+    return;
+  if (tlb_count < tlb_size)
+    ++tlb_count;
+  memmove(&tlb[1], &tlb[0], (tlb_count - 1) * sizeof tlb[0]);
+  tlb[0].virt_page = virt_page;
+  tlb[0].phys_page = phys_page;
+  tlb[0].modified = modified;
+}
+
+static void tlb_invalidate(unsigned virt_page) {
+  for (int i = 0; i < tlb_count; ++i) {
+    if (tlb[i].virt_page == virt_page) {
+      memmove(&tlb[i], &tlb[i + 1], (tlb_count - i - 1) * sizeof tlb[0]);
+      --tlb_count;
+      return;
+    }
+  }
+}
+
+static void print_tlb_stats() {
+  if (tlb_size > 0)
+    printf("%llu TLB hits, %llu TLB misses (%.1f%% hit rate)\n", num_tlbhits,
+           num_tlbmisses, 100.0 * num_tlbhits / (num_tlbhits + num_tlbmisses));
+}
+
 static void read_page(unsigned phys_page, unsigned swap_page) {
   ++num_diskreads;
   memcpy(&memory[phys_page * PAGESIZE], &swap[swap_page * PAGESIZE],
@@ -137,6 +236,8 @@ static unsigned second_chance_replace() {
       break;
     }
     coremap[page].owner->referenced = 0;
+    /* Have the next access set it again. */
+    tlb_invalidate(coremap[page].owner - page_table);
     ++page;
     page %= RAM_PAGES;
   }
@@ -207,6 +308,7 @@ static unsigned take_phys_page() {
       // In this case the page is in use.
       // Save the page if modified.
       owner->inmemory = 0;
+      tlb_invalidate(owner - page_table);
       swap_page = coremap[phys_page].page;
       if (owner->modified) {
         if (!owner->ondisk) {
@@ -261,6 +363,7 @@ static void quit_signal_handler(int signal) {
     printf("\n%llu page faults\n", num_pagefault);
     printf("%llu disk reads\n", num_diskreads);
     printf("%llu disk writes\n", num_diskwrites);
+    print_tlb_stats();
     exit(1);
   }
 }
@@ -287,6 +390,7 @@ static void pagefault(unsigned virt_page) {
   unsigned swap_page = 0;
 
   num_pagefault += 1;
+  tlb_invalidate(virt_page);
   phys_page = take_phys_page();
 
   /* TO COMPLETE */
@@ -320,6 +424,22 @@ static void translate(unsigned virt_addr, unsigned *phys_addr, bool write) {
 
   //page_accesses[num_memoryaccesses++] = virt_page;
 
+  if (tlb_size > 0) {
+    tlb_entry_t *hit = tlb_lookup(virt_page);
+
+    if (hit != NULL) {
+      ++num_tlbhits;
+      /* Referenced was set when it went into the TLB. */
+      if (write && !hit->modified) {
+        page_table[virt_page].modified = 1;
+        hit->modified = true;
+      }
+      *phys_addr = hit->phys_page * PAGESIZE + offset;
+      return;
+    }
+    ++num_tlbmisses;
+  }
+
   if (!page_table[virt_page].inmemory)
     pagefault(virt_page);
 
@@ -328,6 +448,7 @@ static void translate(unsigned virt_addr, unsigned *phys_addr, bool write) {
   if (write)
     page_table[virt_page].modified = 1;
 
+  tlb_insert(virt_page, page_table[virt_page].page, page_table[virt_page].modified);
   *phys_addr = page_table[virt_page].page * PAGESIZE + offset;
 }
 
@@ -387,6 +508,7 @@ void read_program(char *file, unsigned memory[], int *ninstr) {
       error("syntax error near: \"%s\"", text);
 
     write_memory(memory, line, make_instr(opcode, a, b, c));
+    decode(&decoded[line], make_instr(opcode, a, b, c));
 
     line += 1;
   }
@@ -394,24 +516,124 @@ void read_program(char *file, unsigned memory[], int *ninstr) {
   *ninstr = line;
 }
 
+static void set_trace_level(int level) {
+#ifndef NO_TRACE
+  trace_level = level;
+#endif
+}
+
+static void set_tlb_size(int size) {
+  if (size < 0 || size > TLB_MAX)
+    error("TLB size must be 0 to %d", TLB_MAX);
+  tlb_size = size;
+}
+
+static void print_registers(cpu_t *cpu) {
+  int i;
+  int j;
+
+  i = 0;
+  while (i < NREG) {
+    for (j = 0; j < 4; ++j, ++i) {
+      if (j > 0)
+        printf("| ");
+      printf("R%02d = %-12d", i, cpu->reg[i]);
+    }
+    printf("\n");
+  }
+}
+
+/*
+ * run() jumps from the code of one instruction straight to the code of the
+ * next, through the address of that code kept in its decoded[] entry
+ * (computed goto, a GNU C extension; other compilers get a switch instead).
+ */
+#ifdef __GNUC__
+#define THREADED
+#endif
+
 int run(int argc, char **argv) {
   char *file;
   cpu_t cpu;
   int i;
-  int j;
   int ninstr;
-  unsigned instr;
-  unsigned opcode;
-  unsigned source_reg1;
-  int constant;
-  unsigned dest_reg;
+  decoded_t *in;  /* Instruction being executed. */
   int source1;
   int source2;
-  int dest;
-  unsigned data;
-  bool proceed;
-  bool increment_pc;
-  bool writeback;
+  int result;
+  unsigned addr;
+  unsigned phys_addr;
+
+#ifdef THREADED
+  static const void *handlers[] = {
+      [ADD] = __extension__ &&op_ADD,   [ADDI] = __extension__ &&op_ADDI,
+      [SUB] = __extension__ &&op_SUB,   [SUBI] = __extension__ &&op_SUBI,
+      [SGE] = __extension__ &&op_SGE,   [SGT] = __extension__ &&op_SGT,
+      [SEQ] = __extension__ &&op_SEQ,   [SEQI] = __extension__ &&op_SEQI,
+      [BT] = __extension__ &&op_BT,     [BF] = __extension__ &&op_BF,
+      [BA] = __extension__ &&op_BA,     [ST] = __extension__ &&op_ST,
+      [LD] = __extension__ &&op_LD,     [CALL] = __extension__ &&op_CALL,
+      [JMP] = __extension__ &&op_JMP,   [MUL] = __extension__ &&op_MUL,
+      [HALT] = __extension__ &&op_HALT,
+  };
+#define OP(name) op_##name
+#define OP_ILLEGAL op_illegal
+#define HANDLER(opcode)                                                        \
+  ((opcode) <= HALT ? handlers[opcode] : __extension__ &&op_illegal)
+#define DISPATCH() __extension__({ goto *in->handler; })
+#else
+#define OP(name) case name
+#define OP_ILLEGAL default
+#define HANDLER(opcode) NULL
+#define DISPATCH() goto dispatch
+#endif
+
+  /*
+   * Fetches the instruction at pc. A decoded instruction is not read again,
+   * but the fetch still goes through translate(), so that it counts in the
+   * paging statistics like any other memory access.
+   */
+#define FETCH()                                                                \
+  do {                                                                         \
+    if (cpu.pc >= VIRT_SIZE)                                                   \
+      error("pc out of range: %u", cpu.pc);                                    \
+    in = &decoded[cpu.pc];                                                     \
+    if (in->valid) {                                                           \
+      translate(cpu.pc, &phys_addr, false);                                    \
+    } else {                                                                   \
+      decode(in, read_memory(memory, cpu.pc));                                 \
+      in->handler = HANDLER(in->opcode);                                       \
+    }                                                                          \
+    source1 = cpu.reg[in->source_reg1];                                        \
+    source2 = cpu.reg[in->constant & (NREG - 1)];                              \
+    if (trace_level >= TRACE_INSTR)                                            \
+      printf("pc = %3d: ", cpu.pc);                                            \
+  } while (0)
+
+#define TRACE(mnemonic)                                                        \
+  do {                                                                         \
+    if (trace_level >= TRACE_INSTR)                                            \
+      puts(mnemonic);                                                          \
+  } while (0)
+
+#define NEXT()                                                                 \
+  do {                                                                         \
+    if (trace_level >= TRACE_REGISTERS)                                        \
+      print_registers(&cpu);                                                   \
+    FETCH();                                                                   \
+    DISPATCH();                                                                \
+  } while (0)
+
+  /* Writes the result to the destination register and goes on. The value is
+   * computed even if it goes to R0, as a load still accesses memory. */
+#define WRITE_NEXT(value)                                                      \
+  do {                                                                         \
+    result = (value);                                                          \
+    if (in->dest_reg != 0)                                                     \
+      cpu.reg[in->dest_reg] = result;                                          \
+    cpu.pc += 1;                                                               \
+    NEXT();                                                                    \
+  } while (0)
 
   if (argc > 2)
     file = argv[2];
@@ -419,176 +641,142 @@ int run(int argc, char **argv) {
     file = "a.s";
 
   read_program(file, memory, &ninstr);
+  for (i = 0; i < ninstr; ++i)
+    decoded[i].handler = HANDLER(decoded[i].opcode);
 
   /* First instruction to execute is at address 0. */
   cpu.pc = 0;
   cpu.reg[0] = 0;
 
-  proceed = true;
-
-  while (proceed) {
-
-    /* Fetch next instruction to execute. */
-    instr = read_memory(memory, cpu.pc);
-
-    /* Decode the instruction. */
-    opcode = extract_opcode(instr);
-    source_reg1 = extract_source1(instr);
-    constant = extract_constant(instr);
-    dest_reg = extract_dest(instr);
-
-    /* Fetch operands. */
-    source1 = cpu.reg[source_reg1];
-    source2 = cpu.reg[constant & (NREG - 1)];
-
-    increment_pc = true;
-    writeback = true;
-
-    printf("pc = %3d: ", cpu.pc);
-
-    switch (opcode) {
-    case ADD:
-      puts("ADD");
-      dest = source1 + source2;
-      break;
-
-    case ADDI:
-      puts("ADDI");
-      dest = source1 + constant;
-      break;
-
-    case SUB:
-      puts("SUB");
-      dest = source1 - source2;
-      break;
-
-    case SUBI:
-      puts("SUBI");
-      dest = source1 - constant;
-      break;
-
-    case MUL:
-      puts("MUL");
-      dest = source1 * source2;
-      break;
-
-    case SGE:
-      puts("SGE");
-      dest = source1 >= source2;
-      break;
-
-    case SGT:
-      puts("SGT");
-      dest = source1 > source2;
-      break;
-
-    case SEQ:
-      puts("SEQ");
-      dest = source1 == source2;
-      break;
-
-    case SEQI:
-      puts("SEQI");
-      dest = source1 == constant;
-      break;
-
-    case BT:
-      puts("BT");
-      writeback = false;
-      if (source1 != 0) {
-        cpu.pc = constant;
-        increment_pc = false;
-      }
-      break;
+  FETCH();
+#ifdef THREADED
+  DISPATCH();
+#else
+dispatch:
+  switch (in->opcode) {
+#endif
 
-    case BF:
-      puts("BF");
-      writeback = false;
-      if (source1 == 0) {
-        cpu.pc = constant;
-        increment_pc = false;
-      }
-      break;
+  OP(ADD):
+    TRACE("ADD");
+    WRITE_NEXT(source1 + source2);
 
-    case BA:
-      puts("BA");
-      writeback = false;
-      increment_pc = false;
-      cpu.pc = constant;
-      break;
+  OP(ADDI):
+    TRACE("ADDI");
+    WRITE_NEXT(source1 + in->constant);
 
-    case LD:
-      puts("LD");
-      data = read_memory(memory, source1 + constant);
-      dest = data;
-      break;
+  OP(SUB):
+    TRACE("SUB");
+    WRITE_NEXT(source1 - source2);
 
-    case ST:
-      puts("ST");
-      data = cpu.reg[dest_reg];
-      write_memory(memory, source1 + constant, data);
-      writeback = false;
-      break;
+  OP(SUBI):
+    TRACE("SUBI");
+    WRITE_NEXT(source1 - in->constant);
 
-    case CALL:
-      puts("CALL");
-      increment_pc = false;
-      dest = cpu.pc + 1;
-      dest_reg = 31;
-      cpu.pc = constant;
-      break;
+  OP(MUL):
+    TRACE("MUL");
+    WRITE_NEXT(source1 * source2);
 
-    case JMP:
-      puts("JMP");
-      increment_pc = false;
-      writeback = false;
-      cpu.pc = source1;
-      break;
+  OP(SGE):
+    TRACE("SGE");
+    WRITE_NEXT(source1 >= source2);
 
-    case HALT:
-      puts("HALT");
-      increment_pc = false;
-      writeback = false;
-      proceed = false;
-      break;
+  OP(SGT):
+    TRACE("SGT");
+    WRITE_NEXT(source1 > source2);
 
-    default:
-      error("illegal instruction at pc = %d: opcode = %d\n", cpu.pc, opcode);
-    }
+  OP(SEQ):
+    TRACE("SEQ");
+    WRITE_NEXT(source1 == source2);
 
-    if (writeback && dest_reg != 0)
-      cpu.reg[dest_reg] = dest;
+  OP(SEQI):
+    TRACE("SEQI");
+    WRITE_NEXT(source1 == in->constant);
 
-    if (increment_pc)
+  OP(BT):
+    TRACE("BT");
+    if (source1 != 0)
+      cpu.pc = in->constant;
+    else
       cpu.pc += 1;
+    NEXT();
 
-#ifdef DEBUG
-    i = 0;
-    while (i < NREG) {
-      for (j = 0; j < 4; ++j, ++i) {
-        if (j > 0)
-          printf("| ");
-        printf("R%02d = %-12d", i, cpu.reg[i]);
-      }
-      printf("\n");
-    }
-#endif
+  OP(BF):
+    TRACE("BF");
+    if (source1 == 0)
+      cpu.pc = in->constant;
+    else
+      cpu.pc += 1;
+    NEXT();
+
+  OP(BA):
+    TRACE("BA");
+    cpu.pc = in->constant;
+    NEXT();
+
+  OP(LD):
+    TRACE("LD");
+    WRITE_NEXT(read_memory(memory, source1 + in->constant));
+
+  OP(ST):
+    TRACE("ST");
+    addr = source1 + in->constant;
+    write_memory(memory, addr, cpu.reg[in->dest_reg]);
+    /* The program may overwrite its own code. */
+    if (addr < VIRT_SIZE)
+      decoded[addr].valid = false;
+    cpu.pc += 1;
+    NEXT();
+
+  OP(CALL):
+    TRACE("CALL");
+    cpu.reg[31] = cpu.pc + 1;
+    cpu.pc = in->constant;
+    NEXT();
+
+  OP(JMP):
+    TRACE("JMP");
+    cpu.pc = source1;
+    NEXT();
+
+  OP(HALT):
+    TRACE("HALT");
+    if (trace_level >= TRACE_REGISTERS)
+      print_registers(&cpu);
+    goto halted;
+
+  OP_ILLEGAL:
+    error("illegal instruction at pc = %d: opcode = %d\n", cpu.pc, in->opcode);
+
+#ifndef THREADED
   }
+#endif
 
-  i = 0;
-  while (i < NREG) {
-    for (j = 0; j < 4; ++j, ++i) {
-      if (j > 0)
-        printf("| ");
-      printf("R%02d = %-12d", i, cpu.reg[i]);
-    }
-    printf("\n");
-  }
+halted:
+  print_registers(&cpu);
   return 0;
 }
 
 int main(int argc, char **argv) {
+  static char trace_buf[TRACE_BUFSIZE];
+
+  /* The trace goes out in big writes instead of a line at a time. */
+  setvbuf(stdout, trace_buf, _IOFBF, sizeof trace_buf);
+
   replace = fifo_page_replace;
+  /* Options come before the page replacement algorithm. */
+  while (argc >= 2) {
+    if (!strcmp(argv[1], "--quiet"))
+      set_trace_level(TRACE_NONE);
+    else if (!strcmp(argv[1], "--trace-registers"))
+      set_trace_level(TRACE_REGISTERS);
+    else if (!strncmp(argv[1], "--tlb=", 6))
+      set_tlb_size(atoi(argv[1] + 6));
+    else
+      break;
+    argv[1] = argv[0];
+    ++argv;
+    --argc;
+  }
   if (argc >= 2) {
     if (!strcmp(argv[1], "--second-chance")) {
       replace = second_chance_replace;
@@ -615,6 +803,7 @@ int main(int argc, char **argv) {
   printf("%llu page faults\n", num_pagefault);
   printf("%llu disk reads\n", num_diskreads);
   printf("%llu disk writes\n", num_diskwrites);
+  print_tlb_stats();
   
   /*
   printf("\nPage accesses:\n");
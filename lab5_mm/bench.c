@@ -0,0 +1,347 @@
+// Benchmark for ll-mm.c: replays an allocation trace and reports throughput,
+// p99 latency, peak heap, utilization and fragmentation.
+//   ./bench trace.rep ...        replay traces in the CMU trace format
+//   ./bench -g uniform [-n ops]  replay a synthetic trace, one of uniform,
+//                                powerlaw or prodcons
+//   ./bench -g uniform -w out.rep
+//                                write a synthetic trace instead
+//   ./bench -s out.snap ...      also write heap snapshots while replaying,
+//                                for heapviz.py
+// Built with -DBENCH_GLIBC it runs on the malloc of the C library instead,
+// to have something to compare with.
+//
+// A CMU trace starts with four numbers: suggested heap size (ignored), number
+// of block ids, number of operations and weight (ignored), followed by one
+// operation per line: "a id size", "r id size" or "f id".
+#ifdef BENCH_GLIBC
+#define _GNU_SOURCE
+#include <malloc.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+#else
+#include "ll-mm.c"
+#endif
+#include <time.h>
+
+#define DEFAULT_OPS (1000000)
+// latencies are counted per nanosecond up to this, slower ones in the last bin
+#define MAX_LATENCY (100000)
+// number of times per replay the fragmentation is sampled
+#define FRAG_SAMPLES (64)
+
+typedef struct op_s {
+  char type; // 'a', 'r' or 'f'
+  uint32_t id;
+  uint32_t size;
+} op;
+
+static op* ops; // the trace
+static size_t num_ops;
+static uint32_t num_ids;
+static void** ptrs; // block of every id
+static uint32_t* sizes; // requested size of every id
+static uint32_t latency[MAX_LATENCY];
+static int snap_fd = -1; // where heap snapshots go, if anywhere
+
+// Memory for the bookkeeping of the benchmark, kept out of the heap that is
+// measured.
+static void* bench_alloc(size_t n) {
+  void* p = mmap(NULL, n, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    fprintf(stderr, "bench: out of memory\n");
+    exit(1);
+  }
+  return p;
+}
+
+static void bench_setup(size_t nops, uint32_t nids) {
+  num_ops = 0;
+  num_ids = nids;
+  ops = bench_alloc(nops * sizeof(op));
+  ptrs = bench_alloc(nids * sizeof(void*));
+  sizes = bench_alloc(nids * sizeof(uint32_t));
+}
+
+static void add_op(char type, uint32_t id, uint32_t size) {
+  ops[num_ops++] = (op){type, id, size};
+}
+
+#ifdef BENCH_GLIBC
+static const char* allocator() { return "glibc"; }
+
+// memory taken from the system by the main arena and for mapped blocks
+static size_t footprint() {
+  struct mallinfo2 mi = mallinfo2();
+  return mi.arena + mi.hblkhd;
+}
+
+static double fragmentation() { return -1; }
+
+static void heap_restart() { malloc_trim(0); }
+
+static void snapshot() {}
+#else
+static const char* allocator() {
+  static const char* names[] = {"ll-mm/good", "ll-mm/first", "ll-mm/next", "ll-mm/best"};
+  return names[fit];
+}
+
+// memory taken from the system: the heap and the mapped blocks
+static size_t footprint() { return heap_size() + mapped_size; }
+
+// share of the free memory in the heap outside of the largest free block
+static double fragmentation() {
+  size_t total = 0, largest = 0;
+  for (arena* a = arenas; a < arenas + MM_ARENAS; a++) {
+    for (block* pb = a->first; a->first != NULL && pb != a->heap_end; pb = block_next(pb)) {
+      if (!is_free(pb)) continue;
+      total += block_total_size(pb);
+      if (block_total_size(pb) > largest) largest = block_total_size(pb);
+    }
+  }
+  return total == 0 ? 0 : 1.0 - (double)largest / total;
+}
+
+// starts over from an empty heap; nothing may be allocated at this point
+static void heap_restart() { reset(); }
+
+static void snapshot() {
+  if (snap_fd >= 0) dump_heap(snap_fd);
+}
+#endif
+
+/* Traces */
+
+static bool load_trace(const char* path) {
+  FILE* f = fopen(path, "r");
+  if (f == NULL) {
+    perror(path);
+    return false;
+  }
+  unsigned long heap, nids, nops, weight;
+  if (fscanf(f, "%lu %lu %lu %lu", &heap, &nids, &nops, &weight) != 4) {
+    fprintf(stderr, "%s: bad header\n", path);
+    fclose(f);
+    return false;
+  }
+  bench_setup(nops, nids);
+  char type;
+  unsigned long id, size = 0;
+  while (fscanf(f, " %c %lu", &type, &id) == 2) {
+    if ((type == 'a' || type == 'r') && fscanf(f, "%lu", &size) != 1) break;
+    if (num_ops == nops || id >= nids || (type != 'a' && type != 'r' && type != 'f')) break;
+    add_op(type, id, size);
+  }
+  bool ok = feof(f) && num_ops == nops;
+  if (!ok) fprintf(stderr, "%s: bad operation %zu\n", path, num_ops + 1);
+  fclose(f);
+  return ok;
+}
+
+static bool write_trace(const char* path) {
+  FILE* f = fopen(path, "w");
+  if (f == NULL) {
+    perror(path);
+    return false;
+  }
+  fprintf(f, "0\n%u\n%zu\n1\n", num_ids, num_ops);
+  for (size_t i = 0; i < num_ops; i++) {
+    if (ops[i].type == 'f') fprintf(f, "f %u\n", ops[i].id);
+    else fprintf(f, "%c %u %u\n", ops[i].type, ops[i].id, ops[i].size);
+  }
+  return fclose(f) == 0;
+}
+
+/* Synthetic traces */
+
+// xorshift, so that every run gets the same trace
+static uint32_t rnd() {
+  static uint32_t x = 2463534242u;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return x;
+}
+
+// sizes from 1 to 4 KiB, all equally likely
+static uint32_t uniform_size() { return 1 + rnd() % 4096; }
+
+// sizes doubling with every halving of their likelihood, up to 1 MiB: many
+// small blocks and a long tail of big ones
+static uint32_t powerlaw_size() {
+  unsigned k = __builtin_ctz(rnd() | (1u << 16));
+  return (1 + rnd() % 16) << k;
+}
+
+// Random mallocs, reallocs and frees of blocks living for a random time.
+static void gen_random(size_t nops, uint32_t (*pick_size)()) {
+  const uint32_t nids = 4096;
+  bench_setup(nops + nids, nids);
+  bool* live = bench_alloc(nids * sizeof(bool));
+  while (num_ops < nops) {
+    uint32_t id = rnd() % nids;
+    if (!live[id]) add_op('a', id, pick_size());
+    else if (rnd() % 4 == 0) add_op('r', id, pick_size());
+    else add_op('f', id, 0);
+    live[id] = ops[num_ops - 1].type != 'f';
+  }
+  for (uint32_t id = 0; id < nids; id++) {
+    if (live[id]) add_op('f', id, 0);
+  }
+  munmap(live, nids * sizeof(bool));
+}
+
+// A producer queueing up bursts of messages and a consumer freeing them in
+// the order they were made, so that blocks are freed first in, first out.
+static void gen_prodcons(size_t nops) {
+  const uint32_t nids = 4096;
+  bench_setup(nops + nids, nids);
+  uint32_t head = 0, tail = 0; // next message to make and to consume
+  while (num_ops < nops) {
+    for (uint32_t n = 1 + rnd() % 64; n > 0 && head - tail < nids; n--, head++) {
+      add_op('a', head % nids, 64 + rnd() % 1984);
+    }
+    uint32_t keep = rnd() % (nids / 2);
+    for (; head - tail > keep; tail++) add_op('f', tail % nids, 0);
+  }
+  for (; tail != head; tail++) add_op('f', tail % nids, 0);
+}
+
+/* Replay */
+
+static uint64_t now_ns() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+static void run_op(op* o) {
+  switch (o->type) {
+  case 'a':
+    ptrs[o->id] = malloc(o->size);
+    break;
+  case 'r':
+    ptrs[o->id] = realloc(ptrs[o->id], o->size);
+    break;
+  default:
+    free(ptrs[o->id]);
+    ptrs[o->id] = NULL;
+    return;
+  }
+  if (ptrs[o->id] == NULL && o->size > 0) {
+    fprintf(stderr, "bench: out of memory\n");
+    exit(1);
+  }
+}
+
+// frees the blocks the trace left allocated
+static void free_all() {
+  for (uint32_t id = 0; id < num_ids; id++) {
+    free(ptrs[id]);
+    ptrs[id] = NULL;
+  }
+}
+
+// The trace is replayed twice: once as fast as possible for the throughput,
+// and once timing every operation and looking at the heap after it.
+static void replay(const char* name) {
+  heap_restart();
+  uint64_t start = now_ns();
+  for (size_t i = 0; i < num_ops; i++) run_op(&ops[i]);
+  uint64_t elapsed = now_ns() - start;
+  free_all();
+
+  heap_restart();
+  memset(latency, 0, sizeof(latency));
+  memset(sizes, 0, num_ids * sizeof(uint32_t));
+  size_t live = 0, peak_live = 0, peak_heap = 0;
+  double frag = 0;
+  size_t sample = num_ops / FRAG_SAMPLES + 1, samples = 0;
+  for (size_t i = 0; i < num_ops; i++) {
+    op* o = &ops[i];
+    uint64_t t0 = now_ns();
+    run_op(o);
+    uint64_t t = now_ns() - t0;
+    latency[t < MAX_LATENCY ? t : MAX_LATENCY - 1]++;
+
+    live -= sizes[o->id];
+    sizes[o->id] = o->type == 'f' ? 0 : o->size;
+    live += sizes[o->id];
+    if (live > peak_live) peak_live = live;
+    if (footprint() > peak_heap) peak_heap = footprint();
+    if (i % sample == 0) {
+      frag += fragmentation();
+      samples++;
+      snapshot();
+    }
+  }
+  free_all();
+
+  size_t p99 = 0;
+  for (size_t seen = latency[0]; seen < num_ops - num_ops / 100; ) seen += latency[++p99];
+  printf("%-24s %-12s %11.0f ops/s  p99 %6zu ns  peak heap %8zu KiB  utilization %5.1f%%",
+         name, allocator(), num_ops / (elapsed / 1e9), p99, peak_heap / 1024,
+         peak_heap == 0 ? 100.0 : 100.0 * peak_live / peak_heap);
+  if (frag >= 0) printf("  fragmentation %5.1f%%\n", 100.0 * frag / samples);
+  else printf("\n");
+}
+
+int main(int argc, char* argv[]) {
+  // a buffer of its own, as the heap is started over for every trace
+  static char outbuf[BUFSIZ];
+  setvbuf(stdout, outbuf, _IOLBF, sizeof(outbuf));
+  const char* gen = NULL;
+  const char* out = NULL;
+  size_t nops = DEFAULT_OPS;
+  int c;
+  while ((c = getopt(argc, argv, "g:n:s:w:")) != -1) {
+    switch (c) {
+    case 'g':
+      gen = optarg;
+      break;
+    case 'n':
+      nops = strtoul(optarg, NULL, 10);
+      break;
+    case 's':
+      snap_fd = open(optarg, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (snap_fd < 0) {
+        perror(optarg);
+        return 1;
+      }
+      break;
+    case 'w':
+      out = optarg;
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-g uniform|powerlaw|prodcons] [-n ops] [-s snapshots] [-w out] "
+              "[trace ...]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  if (gen != NULL) {
+    if (strcmp(gen, "uniform") == 0) gen_random(nops, uniform_size);
+    else if (strcmp(gen, "powerlaw") == 0) gen_random(nops, powerlaw_size);
+    else if (strcmp(gen, "prodcons") == 0) gen_prodcons(nops);
+    else {
+      fprintf(stderr, "%s: unknown generator %s\n", argv[0], gen);
+      return 1;
+    }
+    if (out != NULL) return write_trace(out) ? 0 : 1;
+    replay(gen);
+    return 0;
+  }
+
+  int status = 0;
+  for (int i = optind; i < argc; i++) {
+    if (load_trace(argv[i])) replay(argv[i]);
+    else status = 1;
+  }
+  return status;
+}
@@ -0,0 +1,212 @@
+// Differential fuzzer for the allocators: runs a random sequence of malloc,
+// calloc, realloc and free calls, the same one for a given seed, and checks
+// that every block is aligned, that calloc() clears it and that it keeps
+// what was written to it until it is resized or freed. Reports the
+// throughput, the peak RSS and a digest of all the data read back, which
+// must come out the same for every allocator.
+//   ./fuzz [-n ops] [-s seed]
+// Built against ll-mm.c, against the completed lab skeleton prewritten-mm.c
+// with -DFUZZ_PREWRITTEN, or on the malloc of the C library with
+// -DFUZZ_GLIBC. 'make run-fuzz' runs all three and compares them.
+#define _GNU_SOURCE
+#if defined(FUZZ_GLIBC)
+#include <errno.h>
+#include <stdalign.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#elif defined(FUZZ_PREWRITTEN)
+#include "prewritten-mm.c"
+#else
+#include "ll-mm.c"
+#endif
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#define DEFAULT_OPS (200000)
+// blocks alive at a time; the list walks of prewritten-mm.c grow with it
+#define SLOTS (1024)
+
+typedef struct slot_s {
+  bool live; // holds a block, which may be NULL for a zero size
+  uint8_t* ptr;
+  size_t size;
+  uint8_t tag; // what the data was filled from
+} slot;
+
+static slot* slots;
+static uint64_t digest = 14695981039346656037ull; // FNV-1a
+static size_t failures;
+
+static const char* allocator() {
+#if defined(FUZZ_GLIBC)
+  return "glibc";
+#elif defined(FUZZ_PREWRITTEN)
+  return "prewritten";
+#else
+  return "ll-mm";
+#endif
+}
+
+// xorshift, so that a seed always gives the same sequence
+static uint64_t rnd_state;
+static uint32_t rnd() {
+  rnd_state ^= rnd_state << 13;
+  rnd_state ^= rnd_state >> 7;
+  rnd_state ^= rnd_state << 17;
+  return (uint32_t)(rnd_state >> 32);
+}
+
+// mostly small blocks, some of a few KiB and now and then a big one, past
+// the mmap threshold of ll-mm.c
+static size_t pick_size() {
+  uint32_t r = rnd() % 1000;
+  if (r < 5) return 0;
+  if (r < 800) return 1 + rnd() % 256;
+  if (r < 995) return 1 + rnd() % 8192;
+  return 1 + rnd() % 300000;
+}
+
+static uint8_t pattern(uint8_t tag, size_t i) {
+  return (uint8_t)(tag + i * 31 + (i >> 8));
+}
+
+static void fail(const char* what, size_t op, slot* s) {
+  if (failures++ < 10) {
+    fprintf(stderr, "%s: op %zu: %s (block %p, %zu bytes)\n", allocator(), op, what, s->ptr,
+            s->size);
+  }
+}
+
+// checks that the new block of s is aligned, then fills it
+static void fill(slot* s, size_t op) {
+  if (s->size != 0 && (uintptr_t)s->ptr % alignof(max_align_t) != 0) fail("misaligned", op, s);
+  for (size_t i = 0; i < s->size; i++) s->ptr[i] = pattern(s->tag, i);
+}
+
+// checks that the first n bytes of s are as filled, and adds them to the digest
+static void check(slot* s, size_t n, size_t op) {
+  bool ok = true;
+  for (size_t i = 0; i < n; i++) {
+    ok &= s->ptr[i] == pattern(s->tag, i);
+    digest = (digest ^ s->ptr[i]) * 1099511628211ull;
+  }
+  if (!ok) fail("data changed", op, s);
+}
+
+// Runs ops operations from seed. With checking the blocks are filled and
+// checked, else only the calls to the allocator are made, for timing. What
+// comes next only depends on the seed, not on what the allocator returns,
+// so that the allocators all see the same calls.
+static void run(size_t ops, uint64_t seed, bool checking) {
+  rnd_state = seed;
+  for (size_t op = 0; op < ops; op++) {
+    slot* s = &slots[rnd() % SLOTS];
+    uint32_t kind = rnd() % 8;
+    if (!s->live) {
+      s->size = pick_size();
+      s->tag = (uint8_t)rnd();
+      s->ptr = kind < 2 ? calloc(1, s->size) : malloc(s->size);
+      s->live = true;
+      // a NULL is only allowed for a zero size
+      if (s->ptr == NULL && s->size != 0) {
+        fail("out of memory", op, s);
+        s->live = false;
+      }
+      if (!checking || s->ptr == NULL) continue;
+      if (kind < 2) {
+        for (size_t i = 0; i < s->size; i++) {
+          if (s->ptr[i] != 0) {
+            fail("calloc() data not zero", op, s);
+            break;
+          }
+        }
+      }
+      fill(s, op);
+    } else if (kind < 3) {
+      size_t size = pick_size();
+      if (checking) check(s, s->size < size ? s->size : size, op);
+      uint8_t* np = realloc(s->ptr, size);
+      if (np == NULL && size != 0) {
+        fail("realloc() out of memory", op, s);
+        continue;
+      }
+      s->ptr = np;
+      s->size = size;
+      s->tag = (uint8_t)rnd();
+      if (size == 0) {
+        // freed, or else a block for zero bytes that is freed here
+        free(np);
+        s->ptr = NULL;
+        s->live = false;
+      } else if (checking) {
+        fill(s, op);
+      }
+    } else {
+      if (checking) check(s, s->size, op);
+      free(s->ptr);
+      s->ptr = NULL;
+      s->live = false;
+    }
+  }
+  for (slot* s = slots; s < slots + SLOTS; s++) {
+    if (checking && s->live) check(s, s->size, ops);
+    free(s->ptr);
+    s->ptr = NULL;
+    s->live = false;
+  }
+}
+
+static uint64_t now_ns() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+int main(int argc, char* argv[]) {
+  size_t ops = DEFAULT_OPS;
+  uint64_t seed = 1;
+  int c;
+  while ((c = getopt(argc, argv, "n:s:")) != -1) {
+    switch (c) {
+    case 'n':
+      ops = strtoul(optarg, NULL, 10);
+      break;
+    case 's':
+      seed = strtoull(optarg, NULL, 10);
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-n ops] [-s seed]\n", argv[0]);
+      return 1;
+    }
+  }
+  // xorshift gets stuck at zero
+  seed = seed * 0x9e3779b97f4a7c15ull | 1;
+  // kept out of the heap that is tested
+  slots = mmap(NULL, SLOTS * sizeof(slot), PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (slots == MAP_FAILED) {
+    perror("mmap");
+    return 1;
+  }
+
+  uint64_t start = now_ns();
+  run(ops, seed, false);
+  uint64_t elapsed = now_ns() - start;
+  run(ops, seed, true);
+
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  printf("%-12s %11.0f ops/s  peak RSS %8ld KiB  digest %016llx\n", allocator(),
+         ops / (elapsed / 1e9), ru.ru_maxrss, (unsigned long long)digest);
+  if (failures != 0) {
+    fprintf(stderr, "%s: %zu failures\n", allocator(), failures);
+    return 1;
+  }
+  return 0;
+}
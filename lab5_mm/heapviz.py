@@ -0,0 +1,143 @@
+#!/usr/bin/env python3
+"""Renders heap snapshots of ll-mm.c, as written by dump_heap() (one JSON
+line per snapshot, e.g. from ./bench -s out.snap), as an SVG image:
+
+  - a fragmentation map, one row per snapshot from top to bottom, with the
+    heap from its lowest address on the left: the darker, the more of the
+    memory there is in use, red where it is free
+  - a histogram of the free blocks over time, one row per snapshot, with one
+    column per power of two of the block size: the deeper the blue, the more
+    free memory there is in blocks of that size
+
+and prints a line of numbers per snapshot.
+
+usage: heapviz.py snapshots [-o out.svg]
+"""
+import argparse
+import json
+import sys
+
+MAP_WIDTH = 1000
+HIST_WIDTH = 400
+ROW = 6  # height of a row, in pixels
+MARGIN = 20
+
+
+def load(path):
+    with open(path) as f:
+        return [json.loads(line) for line in f if line.strip()]
+
+
+def blocks(snap):
+    """(size, free) of every block, the arenas one after the other"""
+    for a in snap["arenas"]:
+        yield from a["blocks"]
+
+
+def row_map(snap, extent):
+    """share of the memory in use in each column of a row of the map, or None
+    past the end of the heap"""
+    used = [0.0] * MAP_WIDTH
+    total = [0.0] * MAP_WIDTH
+    scale = MAP_WIDTH / extent
+    pos = 0.0
+    for size, free in blocks(snap):
+        start, end = pos * scale, (pos + size) * scale
+        col = int(start)
+        while col < MAP_WIDTH and col < end:
+            part = min(end, col + 1) - max(start, col)
+            total[col] += part
+            if not free:
+                used[col] += part
+            col += 1
+        pos += size
+    return [u / t if t > 0 else None for u, t in zip(used, total)]
+
+
+def free_histogram(snap):
+    """free bytes per power of two of the block size"""
+    hist = {}
+    for size, free in blocks(snap):
+        if free:
+            k = size.bit_length() - 1
+            hist[k] = hist.get(k, 0) + size
+    return hist
+
+
+def color(used):
+    if used is None:
+        return None
+    # red for free memory, fading to dark grey for memory in use, in a few
+    # steps so that neighbouring columns make runs
+    level = round(used * 8) / 8
+    return f"#{int(60 + 160 * (1 - level)):02x}3c3c"
+
+
+def render(snaps, out):
+    extent = max(sum(size for size, _ in blocks(s)) for s in snaps) or 1
+    hists = [free_histogram(s) for s in snaps]
+    ks = sorted({k for h in hists for k in h}) or [0]
+    k_lo, k_hi = ks[0], ks[-1]
+    peak = max((v for h in hists for v in h.values()), default=1)
+    height = 2 * MARGIN + ROW * len(snaps) + MARGIN
+    width = 3 * MARGIN + MAP_WIDTH + HIST_WIDTH
+    cell = HIST_WIDTH / (k_hi - k_lo + 1)
+    svg = [f'<svg xmlns="http://www.w3.org/2000/svg" width="{width}" height="{height}" '
+           f'font-family="monospace" font-size="12">',
+           f'<text x="{MARGIN}" y="14">heap, {extent // 1024} KiB across</text>',
+           f'<text x="{2 * MARGIN + MAP_WIDTH}" y="14">free bytes by block size, '
+           f'2^{k_lo} to 2^{k_hi}</text>']
+    for i, (snap, hist) in enumerate(zip(snaps, hists)):
+        y = MARGIN + i * ROW
+        cols = row_map(snap, extent)
+        # runs of columns of the same color make one rectangle
+        x = 0
+        while x < MAP_WIDTH:
+            c = color(cols[x])
+            run = x + 1
+            while run < MAP_WIDTH and color(cols[run]) == c:
+                run += 1
+            if c is not None:
+                svg.append(f'<rect x="{MARGIN + x}" y="{y}" width="{run - x}" height="{ROW}" '
+                           f'fill="{c}"/>')
+            x = run
+        for k, v in hist.items():
+            shade = int(255 * (1 - v / peak))
+            svg.append(f'<rect x="{2 * MARGIN + MAP_WIDTH + (k - k_lo) * cell:.1f}" y="{y}" '
+                       f'width="{cell:.1f}" height="{ROW}" fill="#{shade:02x}{shade:02x}ff"/>')
+    svg.append("</svg>")
+    with open(out, "w") as f:
+        f.write("\n".join(svg) + "\n")
+
+
+def summary(snaps):
+    print(f"{'snapshot':>8} {'heap KiB':>10} {'free KiB':>10} {'blocks':>8} {'free blocks':>11} "
+          f"{'largest free':>12} {'fragmentation':>13}")
+    for i, snap in enumerate(snaps):
+        heap = free = count = nfree = largest = 0
+        for size, is_free in blocks(snap):
+            heap += size
+            count += 1
+            if is_free:
+                free += size
+                nfree += 1
+                largest = max(largest, size)
+        frag = 1 - largest / free if free else 0
+        print(f"{i:>8} {heap // 1024:>10} {free // 1024:>10} {count:>8} {nfree:>11} "
+              f"{largest:>12} {100 * frag:>12.1f}%")
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Renders heap snapshots of ll-mm.c.")
+    parser.add_argument("snapshots")
+    parser.add_argument("-o", "--out", default="heap.svg")
+    args = parser.parse_args()
+    snaps = load(args.snapshots)
+    if not snaps:
+        sys.exit(f"{args.snapshots}: no snapshots")
+    summary(snaps)
+    render(snaps, args.out)
+
+
+if __name__ == "__main__":
+    main()
@@ -1,24 +1,244 @@
+// for mremap()
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include <assert.h>
 #include <errno.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <signal.h>
+
+/*
+  Build options:
+  -DMM_THREADS  thread-safe build (link with -pthread). The heap is split in
+                arenas with a lock each, and every thread keeps a small cache
+                of freed small blocks which it reuses without taking a lock.
+  -DMM_ARENAS=n -DARENA_SIZE=m
+                number of arenas (default 8 in the thread-safe build, else 1)
+                and the memory reserved for each one but the main arena
+                (default 64 MiB), see "Arenas". The environment variable
+                MM_ARENA=cpu|rr picks how threads are spread over them: by the
+                CPU they run on (the default) or round-robin.
+  -DMMAP_THRESHOLD=n
+                requests of at least n bytes get a mapping of their own
+                instead of a block in the heap (default 128 KiB).
+  -DTRIM_THRESHOLD=n -DTOP_PAD=m
+                once the free block at the top of the heap reaches n bytes
+                the heap is shrunk, leaving m bytes free at the top (defaults
+                128 KiB and 64 KiB). The gap between the two keeps alternating
+                allocations from moving the break back and forth.
+  -DMM_FIT=FIT_GOOD|FIT_FIRST|FIT_NEXT|FIT_BEST
+                placement policy used to pick a free block, see
+                find_free_block() (default FIT_GOOD). The environment
+                variable MM_FIT=good|first|next|best overrides it, it is read
+                once, by the first allocation.
+  -DMM_DEBUG    hardened build for hunting heap corruption: canaries around
+                every block, poisoned and quarantined frees, and an abort
+                with a message on bad pointers, see "Debug mode".
+  MM_STATS_SIGNAL=n MM_STATS_FILE=path (environment)
+                on signal n, append the heap statistics to path, see
+                stats_on_signal().
+
+  A shared build for LD_PRELOAD (see the Makefile) uses -DMM_THREADS and
+  -fvisibility=hidden, so that only the functions marked MM_EXPORT are
+  seen by the program.
+ */
+#ifdef MM_THREADS
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// the malloc API, exported from a shared build
+#define MM_EXPORT __attribute__((visibility("default")))
 
 // for align
 #include <stdalign.h>
 #include <stddef.h>
 #define ALIGNMENT (alignof(max_align_t))
 #define META_SIZE (sizeof(block))
+// a free block needs room for its free list links and its footer
+#define MIN_BLOCK_SIZE (META_SIZE + sizeof(free_links) + sizeof(uint64_t))
+// blocks start this far past an aligned address, so that their data is aligned
+#define BLOCK_OFFSET (ALIGNMENT - META_SIZE)
+
+// flags kept in the low bits of a block header, which are always zero in
+// the size as blocks are a multiple of ALIGNMENT big
+#define FREE_BIT ((uint64_t)1) // this block is unused
+#define PREV_FREE_BIT ((uint64_t)2) // boundary tag: the previous block is free
+#define MAPPED_BIT ((uint64_t)4) // this block has a mapping of its own
+// the top bits of a header hold a magic value, below it the index of the
+// arena the block belongs to, and the bits in between the size
+#define MAGIC_SHIFT (48)
+#define ARENA_SHIFT (40)
+#define ARENA_MASK (((uint64_t)1 << MAGIC_SHIFT) - ((uint64_t)1 << ARENA_SHIFT))
+#define SIZE_MASK (((uint64_t)1 << ARENA_SHIFT) - ALIGNMENT)
+// largest request whose block size still fits the header
+#define MAX_REQUEST (SIZE_MASK / 2)
+
+// segregated free lists: the first SMALL_CLASSES hold exactly one block size
+// each (in ALIGNMENT steps), the rest cover power-of-two ranges of sizes
+#define NUM_CLASSES (32)
+#define SMALL_CLASSES (16)
+// free blocks of this size class and up (above 4 KiB) are kept in a tree
+// ordered by size instead of in free lists, see tree_insert()
+#define TREE_CLASS (20)
+
+// marks a valid block header, see block_magic()
+#define BLOCK_MAGIC (0xb10c)
 
+// placement policies, see find_free_block()
+enum fit_policy { FIT_GOOD, FIT_FIRST, FIT_NEXT, FIT_BEST };
+#ifndef MM_FIT
+#define MM_FIT FIT_GOOD
+#endif
+
+#ifndef MMAP_THRESHOLD
+#define MMAP_THRESHOLD (128 * 1024)
+#endif
+#ifndef TRIM_THRESHOLD
+#define TRIM_THRESHOLD (128 * 1024)
+#endif
+#ifndef TOP_PAD
+#define TOP_PAD (64 * 1024)
+#endif
+
+#ifndef MM_ARENAS
+#ifdef MM_THREADS
+#define MM_ARENAS (8)
+#else
+#define MM_ARENAS (1)
+#endif
+#endif
+#ifndef ARENA_SIZE
+#define ARENA_SIZE (64 * 1024 * 1024)
+#endif
+_Static_assert(MM_ARENAS >= 1 && MM_ARENAS <= 256, "the arena index has 8 bits");
+
+// A block header is a single word: the total size of the block, with the
+// flags in its low bits and the magic value in its top bits. The next block
+// starts right after this one; a free block also keeps its size in its last
+// word (the footer), where the block after it finds it.
 typedef struct block_s {
-  bool is_free; // true if this block is actually unused
-  struct block_s* next; // next block or sbrk(0) if last
-} block __attribute__((aligned(ALIGNMENT)));
+  uint64_t head; // size | flags | arena | magic
+} block;
+
+// Heap statistics, see get_stats(). Sizes are in bytes.
+typedef struct mm_stats_s {
+  size_t arena; // taken for the arenas
+  size_t mapped; // in blocks with a mapping of their own
+  size_t in_use; // data in occupied blocks, thread caches included
+  size_t free; // data in free blocks
+  size_t blocks; // blocks in the heap
+  size_t free_blocks;
+  size_t largest_free; // data in the largest free block
+  size_t sbrk_calls;
+  size_t splits;
+  size_t merges;
+  size_t free_by_class[NUM_CLASSES]; // free blocks in each size class
+} mm_stats;
+
+// An arena is a heap of its own, with its own block list, free lists and
+// lock. The main arena grows with sbrk(), the others inside a region
+// reserved with mmap(), see "Arenas".
+typedef struct arena_s {
+  // head of our list
+  block* first;
+  // last block of our list, the one ending at heap_end
+  block* last;
+  // end of the last block, i.e. sbrk(0) as long as we are the only user of brk
+  void* heap_end;
+  // heads of the free lists, one per size class
+  block* free_lists[NUM_CLASSES];
+  // bit i is set if free_lists[i] is not empty
+  unsigned free_map;
+  // root of the tree of free blocks of TREE_CLASS and up
+  block* tree;
+  // block where the next FIT_NEXT search starts
+  block* rover;
+  // counters kept up to date as the heap changes, see get_stats()
+  mm_stats stats;
+  // region reserved for an arena other than the main one, NULL for the main
+  // arena, and its break: the end of the memory in use
+  uint8_t* region;
+  uint8_t* brk;
+  // the memory from clean up, past the break, is still zero as the system
+  // handed it out, NULL until the break is first looked at; and where that
+  // memory started in what the last growth of the heap handed out
+  uint8_t* clean;
+  uint8_t* fresh;
+#ifdef MM_THREADS
+  // protects all of the arena: the block list and the free lists
+  pthread_mutex_t lock;
+#endif
+} arena;
+
+// a free block keeps its free list links in its (unused) data part
+typedef struct free_links_s {
+  block* prev_free; // previous block in the same free list
+  block* next_free; // next block in the same free list
+} free_links;
+
+// a big free block keeps its links in the red-black tree of free blocks
+// there instead
+typedef struct tree_links_s {
+  block* child[2]; // left and right: smaller and bigger blocks
+  block* parent;
+  bool red;
+} tree_links;
+
+#ifdef MM_THREADS
+static arena arenas[MM_ARENAS] = {[0 ... MM_ARENAS - 1] = {.lock = PTHREAD_MUTEX_INITIALIZER}};
+#else
+static arena arenas[MM_ARENAS];
+#endif
+// the arena on brk, the only one in a build without MM_THREADS
+#define main_arena (&arenas[0])
+// sum of data in blocks with a mapping of their own
+static size_t mapped_size = 0;
+// placement policy in use
+static enum fit_policy fit = MM_FIT;
 
-// head of our list
-static block* first = NULL;
+#ifdef MM_THREADS
+// max number of blocks a thread keeps per small size class
+#define TCACHE_COUNT (16)
+// number of blocks moved between a thread cache and the heap at once
+#define TCACHE_BATCH (8)
+
+// Per thread cache of freed small blocks, one list for each small size
+// class. Cached blocks stay occupied as far as the heap is concerned; they
+// are linked through next_free, and prev_free holds tcache_key(), which
+// catches most double frees.
+typedef struct tcache_s {
+  block* bins[SMALL_CLASSES];
+  unsigned count[SMALL_CLASSES];
+  bool registered; // the exit handler flushing the cache is installed
+} tcache;
+
+// initial-exec, as other TLS models may call malloc() in a shared build
+static _Thread_local tcache thread_cache __attribute__((tls_model("initial-exec")));
+static pthread_key_t tcache_exit_key;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+
+// arena the calling thread allocates from, see thread_arena()
+static _Thread_local arena* my_arena __attribute__((tls_model("initial-exec")));
+// how threads are spread over the arenas, see thread_arena()
+static enum { PICK_CPU, PICK_ROUND_ROBIN } arena_pick = PICK_CPU;
+static unsigned next_arena = 0;
+
+// The lock of arena a. Mapped blocks are counted under the lock of the main
+// arena.
+#define LOCK(a) pthread_mutex_lock(&(a)->lock)
+#define UNLOCK(a) pthread_mutex_unlock(&(a)->lock)
+#else
+#define LOCK(a) ((void)0)
+#define UNLOCK(a) ((void)0)
+#endif
 
 /*
  Helper functions to be used throughout.
@@ -28,10 +248,20 @@ static size_t aligned_size(size_t sz) {
   return (sz + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
 }
 
-// total size of a block - next is the start of next block
+// total size of a block - from the header up to the start of next block
 static size_t block_total_size(block* pb) {
   if(pb == NULL) return 0;
-  else return (uint8_t*)pb->next - (uint8_t*)pb;
+  else return pb->head & SIZE_MASK;
+}
+
+// the block following pb, or heap_end if pb is the last one
+static block* block_next(block* pb) {
+  return (block*)((uint8_t*)pb + block_total_size(pb));
+}
+
+// true if this block is actually unused
+static bool is_free(block* pb) {
+  return (pb->head & FREE_BIT) != 0;
 }
 
 // size of only data part in a block
@@ -53,45 +283,170 @@ static block* data_to_block(void* p) {
   if (p == NULL) return NULL;
   return (block*)p - 1;
 }
+
+// total size of the block needed to hold size bytes of data
+static size_t request_size(size_t size) {
+  size_t total = aligned_size(size + META_SIZE);
+  return total < MIN_BLOCK_SIZE ? MIN_BLOCK_SIZE : total;
+}
+
+// magic value in the top bits of a valid header at pb; mixed with the
+// address so that a header copied somewhere else is not taken for a block
+static uint64_t block_magic(block* pb) {
+  return (uint64_t)(uint16_t)(BLOCK_MAGIC ^ ((uintptr_t)pb / ALIGNMENT)) << MAGIC_SHIFT;
+}
+
+// true if the header at pb carries the magic value
+static bool has_magic(block* pb) {
+  return (pb->head & ~(((uint64_t)1 << MAGIC_SHIFT) - 1)) == block_magic(pb);
+}
+
+// writes a complete header for a block at pb
+static void set_head(block* pb, size_t size, uint64_t flags) {
+  pb->head = block_magic(pb) | size | flags;
+}
+
+// changes the size of block pb, keeping its flags
+static void set_size(block* pb, size_t size) {
+  pb->head = (pb->head & ~SIZE_MASK) | size;
+}
+
+// sets or clears a flag in the header of pb
+static void set_flag(block* pb, uint64_t flag, bool on) {
+  if (on) pb->head |= flag;
+  else pb->head &= ~flag;
+}
+
+// true if pb has a mapping of its own instead of being part of the heap
+static bool is_mapped(block* pb) {
+  return (pb->head & MAPPED_BIT) != 0;
+}
+
+// the arena index bits for blocks of arena a, see set_head()
+static uint64_t arena_bits(arena* a) {
+  return (uint64_t)(a - arenas) << ARENA_SHIFT;
+}
+
+// the arena the heap block pb belongs to
+static arena* block_arena(block* pb) {
+  return &arenas[(pb->head & ARENA_MASK) >> ARENA_SHIFT];
+}
+
+// size of a page, used to round mappings
+static size_t page_size() {
+  static size_t ps = 0;
+  if (ps == 0) ps = (size_t)sysconf(_SC_PAGESIZE);
+  return ps;
+}
+
+// the block physically before pb, found through the footer it ends with
+// note: only valid if PREV_FREE_BIT is set for pb
+static block* prev_block(block* pb) {
+  return (block*)((uint8_t*)pb - ((uint64_t*)pb)[-1]);
+}
+
+// free list links stored in the data part of a free block
+static free_links* block_links(block* pb) {
+  return (free_links*)block_to_data(pb);
+}
+
+// tree links stored in the data part of a big free block
+static tree_links* tree_of(block* pb) {
+  return (tree_links*)block_to_data(pb);
+}
+
+// size class (free list index) for a block of the given total size
+static unsigned size_class(size_t total) {
+  if (total <= SMALL_CLASSES * ALIGNMENT) return total / ALIGNMENT - 1;
+  unsigned cls = SMALL_CLASSES;
+  for (size_t sz = (total - 1) / (2 * SMALL_CLASSES * ALIGNMENT);
+       sz > 0 && cls < NUM_CLASSES - 1; sz >>= 1) {
+    cls++;
+  }
+  return cls;
+}
+
+#ifdef MM_THREADS
+// marker stored in cached blocks, unique for each thread
+static block* tcache_key() {
+  return (block*)&thread_cache;
+}
+
+// sum of data in the blocks cached by the calling thread
+static size_t cached_size() {
+  size_t s = 0;
+  for (unsigned cls = 0; cls < SMALL_CLASSES; cls++) {
+    for (block* pb = thread_cache.bins[cls]; pb != NULL; pb = block_links(pb)->next_free) {
+      s += block_data_size(pb);
+    }
+  }
+  return s;
+}
+#endif
+
+// bytes between the first block and the end of the heap of arena a
+static size_t arena_size(arena* a) {
+  return a->first == NULL ? 0 : (size_t)((uint8_t*)a->heap_end - (uint8_t*)a->first);
+}
+
+// bytes in the heaps of all arenas
+static size_t heap_size() {
+  size_t s = 0;
+  for (unsigned i = 0; i < MM_ARENAS; i++) s += arena_size(&arenas[i]);
+  return s;
+}
 /* end Helper functions */
 
 /*
   The following functions are only required for the testing rig.
+  In the thread-safe build, blocks cached by the calling thread count as
+  unused; caches of other threads count as used.
  */
 // sum of occupied data in blocks
 size_t used_size() {
-  if(first == NULL) return 0;
   size_t s = 0;
-  void* last_addr = sbrk(0);
-  for (block* pb = first; pb != last_addr; pb = pb->next) {
-    if (!pb->is_free) s += block_data_size(pb);
+  for (unsigned i = 0; i < MM_ARENAS; i++) {
+    arena* a = &arenas[i];
+    LOCK(a);
+    s += arena_size(a) - a->stats.free - (a->stats.blocks - a->stats.free_blocks) * META_SIZE;
+    UNLOCK(a);
   }
+  LOCK(main_arena);
+  s += mapped_size;
+  UNLOCK(main_arena);
+#ifdef MM_THREADS
+  s -= cached_size();
+#endif
   return s;
 }
 
 // sum of data in free blocks
 size_t unused_size() {
-  if(first == NULL) return 0;
   size_t s = 0;
-  void* last_addr = sbrk(0);
-  for (block* pb = first; pb != last_addr; pb = pb->next) {
-    if (pb->is_free) s += block_data_size(pb);
+  for (unsigned i = 0; i < MM_ARENAS; i++) {
+    arena* a = &arenas[i];
+    LOCK(a);
+    s += a->stats.free - a->stats.free_blocks * META_SIZE;
+    UNLOCK(a);
   }
+#ifdef MM_THREADS
+  s += cached_size();
+#endif
   return s;
 }
 
 // display list information at stderr
 void display_list() {
   size_t us = 0, es = 0;
-  void* last_addr = sbrk(0);
-  fprintf(stderr, "sbrk(0) = %p\n", last_addr);
+  fprintf(stderr, "sbrk(0) = %p\n", sbrk(0));
   fprintf(stderr, "align: %u, meta: %u\n", (unsigned)ALIGNMENT,
           (unsigned)META_SIZE);
-  if(first != NULL) {
-    for (block* pb = first; pb != last_addr; pb = pb->next) {
+  for (arena* a = arenas; a < arenas + MM_ARENAS; a++) {
+    if(a->first == NULL) continue;
+    for (block* pb = a->first; pb != a->heap_end; pb = block_next(pb)) {
       fprintf(stderr, "(block @ %p) %p:%8ld [%1d]\n", pb, pb + 1, block_data_size(pb),
-              pb->is_free);
-      if (!pb->is_free)
+              is_free(pb));
+      if (!is_free(pb))
         us += block_data_size(pb);
       else
         es += block_data_size(pb);
@@ -101,104 +456,1545 @@ void display_list() {
   fflush(stderr);
 }
 
-// decreases the limit back to the initial
+// decreases the limit back to the initial, and gives the regions of the
+// other arenas back to the system
+// note: in the thread-safe build only the cache of the calling thread is
+// dropped, so no other thread may hold blocks
 void reset() {
-  if (first != NULL) {
-    uint8_t* crtp = sbrk(0);
-//    fprintf(stderr, "Memory used: %p .. %p -- shrink %d\n", (uint8_t*)first, crtp,
-//            (int)((uint8_t*)first - crtp));
-    uint8_t* pend = sbrk((uint8_t*)first - crtp);
-    if ((ssize_t)pend == -1) {
-      // something went wrong!
-      fprintf(stderr, "BRK error!\n");
+#ifdef MM_THREADS
+  memset(thread_cache.bins, 0, sizeof(thread_cache.bins));
+  memset(thread_cache.count, 0, sizeof(thread_cache.count));
+#endif
+  for (arena* a = arenas; a < arenas + MM_ARENAS; a++) {
+    LOCK(a);
+    if (a->region != NULL) {
+      munmap(a->region, ARENA_SIZE);
+      a->region = NULL;
+      a->brk = NULL;
+    } else if (a->first != NULL) {
+      uint8_t* crtp = sbrk(0);
+//      fprintf(stderr, "Memory used: %p .. %p -- shrink %d\n", (uint8_t*)a->first, crtp,
+//              (int)((uint8_t*)a->first - crtp));
+      uint8_t* pend = sbrk((uint8_t*)a->first - crtp);
+      if ((ssize_t)pend == -1) {
+        // something went wrong!
+        fprintf(stderr, "BRK error!\n");
+      }
+//      fprintf(stderr, "New sbrk = %p\n", sbrk(0));
+//      fflush(stderr);
+    }
+    a->first = NULL;
+    a->last = NULL;
+    a->heap_end = NULL;
+    memset(a->free_lists, 0, sizeof(a->free_lists));
+    a->free_map = 0;
+    a->tree = NULL;
+    a->rover = NULL;
+    a->clean = NULL;
+    a->fresh = NULL;
+    memset(&a->stats, 0, sizeof(a->stats));
+    UNLOCK(a);
+  }
+}
+
+/*
+  Statistics, for watching the heap of a running program.
+ */
+// Adds the counters of arena a to st.
+static void add_stats(mm_stats* st, arena* a) {
+  st->free += a->stats.free;
+  st->blocks += a->stats.blocks;
+  st->free_blocks += a->stats.free_blocks;
+  st->sbrk_calls += a->stats.sbrk_calls;
+  st->splits += a->stats.splits;
+  st->merges += a->stats.merges;
+  for (unsigned cls = 0; cls < NUM_CLASSES; cls++) st->free_by_class[cls] += a->stats.free_by_class[cls];
+}
+
+// Current heap statistics, summed over the arenas. The counters are kept up
+// to date as the heap changes; only the largest free block is searched for,
+// at the right end of the tree or else in the list of the highest size class
+// holding any.
+MM_EXPORT mm_stats get_stats() {
+  mm_stats st;
+  memset(&st, 0, sizeof(st));
+  size_t largest = 0;
+  for (arena* a = arenas; a < arenas + MM_ARENAS; a++) {
+    LOCK(a);
+    add_stats(&st, a);
+    if (a->tree != NULL) {
+      block* pb = a->tree;
+      while (tree_of(pb)->child[1] != NULL) pb = tree_of(pb)->child[1];
+      if (block_total_size(pb) > largest) largest = block_total_size(pb);
+    } else if (a->free_map != 0) {
+      for (block* pb = a->free_lists[31 - __builtin_clz(a->free_map)]; pb != NULL; pb = block_links(pb)->next_free) {
+        if (block_total_size(pb) > largest) largest = block_total_size(pb);
+      }
+    }
+    UNLOCK(a);
+  }
+  st.arena = heap_size();
+  LOCK(main_arena);
+  st.mapped = mapped_size;
+  UNLOCK(main_arena);
+  // the counters count sizes of whole blocks
+  st.in_use = st.arena - st.free - (st.blocks - st.free_blocks) * META_SIZE + st.mapped;
+  st.free -= st.free_blocks * META_SIZE;
+  if (largest != 0) st.largest_free = largest - META_SIZE;
+  return st;
+}
+
+// Writes "name value" on a line to fd, without stdio or the heap, so that it
+// can be used from a signal handler.
+static void write_stat(int fd, const char* name, size_t value) {
+  char line[64];
+  size_t n = strlen(name);
+  memcpy(line, name, n);
+  line[n++] = ' ';
+  char digits[24];
+  int d = 0;
+  do {
+    digits[d++] = '0' + value % 10;
+    value /= 10;
+  } while (value != 0);
+  while (d > 0) line[n++] = digits[--d];
+  line[n++] = '\n';
+  ssize_t ignored = write(fd, line, n);
+  (void)ignored;
+}
+
+// Writes the counters to fd, one per line. Only reads counters and does not
+// take the arena locks, so it can run in a signal handler; the numbers may be
+// off by what an interrupted malloc() was just changing.
+MM_EXPORT void dump_stats(int fd) {
+  mm_stats st;
+  memset(&st, 0, sizeof(st));
+  for (arena* a = arenas; a < arenas + MM_ARENAS; a++) add_stats(&st, a);
+  st.arena = heap_size();
+  write_stat(fd, "arena", st.arena);
+  write_stat(fd, "mapped", mapped_size);
+  write_stat(fd, "in_use", st.arena - st.free - (st.blocks - st.free_blocks) * META_SIZE + mapped_size);
+  write_stat(fd, "free", st.free - st.free_blocks * META_SIZE);
+  write_stat(fd, "blocks", st.blocks);
+  write_stat(fd, "free_blocks", st.free_blocks);
+  write_stat(fd, "sbrk_calls", st.sbrk_calls);
+  write_stat(fd, "splits", st.splits);
+  write_stat(fd, "merges", st.merges);
+  for (unsigned cls = 0; cls < NUM_CLASSES; cls++) {
+    char name[] = "free_class_00";
+    name[11] = '0' + cls / 10;
+    name[12] = '0' + cls % 10;
+    if (st.free_by_class[cls] != 0) write_stat(fd, name, st.free_by_class[cls]);
+  }
+  ssize_t ignored = write(fd, "\n", 1);
+  (void)ignored;
+}
+
+// file the signal handler appends to
+static char stats_path[256];
+
+static void stats_handler(int sig) {
+  (void)sig;
+  int saved = errno;
+  int fd = open(stats_path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (fd >= 0) {
+    dump_stats(fd);
+    close(fd);
+  }
+  errno = saved;
+}
+
+// Makes signal sig append the heap statistics to the file at path.
+// Returns 0, or -1 if path is too long or sig can not be caught.
+MM_EXPORT int stats_on_signal(int sig, const char* path) {
+  if (strlen(path) >= sizeof(stats_path)) return -1;
+  strcpy(stats_path, path);
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = stats_handler;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  return sigaction(sig, &sa, NULL);
+}
+
+// Buffered output to a file descriptor for dump_heap(), which can use
+// neither stdio nor the heap while it holds the arena locks.
+typedef struct out_buf_s {
+  int fd;
+  size_t n;
+  char buf[4096];
+} out_buf;
+
+static void out_flush(out_buf* o) {
+  for (size_t done = 0; done < o->n; ) {
+    ssize_t w = write(o->fd, o->buf + done, o->n - done);
+    if (w <= 0) break;
+    done += w;
+  }
+  o->n = 0;
+}
+
+static void out_str(out_buf* o, const char* str) {
+  for (; *str != '\0'; str++) {
+    if (o->n == sizeof(o->buf)) out_flush(o);
+    o->buf[o->n++] = *str;
+  }
+}
+
+static void out_num(out_buf* o, size_t value) {
+  char digits[24];
+  int d = sizeof(digits) - 1;
+  digits[d] = '\0';
+  do {
+    digits[--d] = '0' + value % 10;
+    value /= 10;
+  } while (value != 0);
+  out_str(o, digits + d);
+}
+
+// Writes a snapshot of the heap to fd as one line of JSON:
+//   {"arenas":[{"start":a,"blocks":[[size,free],...]},...],"mapped":m}
+// with the blocks of every arena in address order from start on, size
+// their total size and free 1 for a free block, 0 else; mapped blocks are
+// only counted, in mapped. Appending one line per call makes a file of
+// snapshots over time, for heapviz.py.
+MM_EXPORT void dump_heap(int fd) {
+  out_buf o = {.fd = fd};
+  out_str(&o, "{\"arenas\":[");
+  for (arena* a = arenas; a < arenas + MM_ARENAS; a++) {
+    if (a != arenas) out_str(&o, ",");
+    LOCK(a);
+    out_str(&o, "{\"start\":");
+    out_num(&o, (uintptr_t)a->first);
+    out_str(&o, ",\"blocks\":[");
+    for (block* pb = a->first; pb != NULL && pb != a->heap_end; pb = block_next(pb)) {
+      out_str(&o, pb == a->first ? "[" : ",[");
+      out_num(&o, block_total_size(pb));
+      out_str(&o, is_free(pb) ? ",1]" : ",0]");
     }
-    first = NULL;
-//    fprintf(stderr, "New sbrk = %p\n", sbrk(0));
-//    fflush(stderr);
+    UNLOCK(a);
+    out_str(&o, "]}");
   }
+  out_str(&o, "],\"mapped\":");
+  LOCK(main_arena);
+  out_num(&o, mapped_size);
+  UNLOCK(main_arena);
+  out_str(&o, "}\n");
+  out_flush(&o);
 }
+/* end of Statistics */
 
 /*
   List level block operations. To be used by allocation functions.
+  They work on the heap of arena a.
  */
 
-// Creates a new block by allocating memory with sbrk()
+static uintptr_t page_up(uintptr_t addr) {
+  return (addr + page_size() - 1) & ~(page_size() - 1);
+}
+
+// Keeps track of the memory past the break of arena a that is still zero,
+// after the break moved by incr from old_end: growing hands out zero pages,
+// shrinking gives back the whole pages past the new break, but what is left
+// of the page the break ends in keeps its contents.
+static void track_clean(arena* a, uint8_t* old_end, intptr_t incr) {
+  if (a->clean == NULL) a->clean = (uint8_t*)page_up((uintptr_t)old_end);
+  if (incr > 0) {
+    a->fresh = old_end > a->clean ? old_end : a->clean;
+    if (old_end + incr > a->clean) a->clean = old_end + incr;
+  } else if (incr < 0) {
+    a->clean = (uint8_t*)page_up((uintptr_t)(old_end + incr));
+  }
+}
+
+// Moves the end of the heap of arena a by incr bytes, like sbrk(). The main
+// arena uses sbrk() itself, and fails like sbrk() if someone else has moved
+// the break since, as the memory would not follow on from the heap then.
+// The other arenas move a break of their own inside their region, reserved
+// the first time, and fail once it is full.
+static void* arena_sbrk(arena* a, intptr_t incr) {
+  if (a == main_arena) {
+    if (a->heap_end != NULL && sbrk(0) != a->heap_end) {
+      errno = ENOMEM;
+      return (void*)-1;
+    }
+    void* old_end = sbrk(incr);
+    if ((ssize_t)old_end == -1) return old_end;
+    a->stats.sbrk_calls++;
+    track_clean(a, old_end, incr);
+    return old_end;
+  }
+
+  if (a->region == NULL) {
+    uint8_t* mem = mmap(NULL, ARENA_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem == MAP_FAILED) {
+      errno = ENOMEM;
+      return (void*)-1;
+    }
+    a->region = mem;
+    a->brk = mem;
+  }
+  uint8_t* old_end = a->brk;
+  if (incr > a->region + ARENA_SIZE - old_end || -incr > old_end - a->region) {
+    errno = ENOMEM;
+    return (void*)-1;
+  }
+  if (incr < 0) {
+    // the pages past the new break are not needed anymore
+    uintptr_t from = page_up((uintptr_t)(old_end + incr));
+    uintptr_t to = page_up((uintptr_t)old_end);
+    if (from < to) madvise((void*)from, to - from, MADV_DONTNEED);
+  }
+  a->brk = old_end + incr;
+  a->stats.sbrk_calls++;
+  track_clean(a, old_end, incr);
+  return old_end;
+}
+
+// Creates a new block by allocating memory with arena_sbrk()
 // the new block is created as occupied and is by default attached
-// as the last block in the list (by the use of next).
-static block* new_block(size_t size) {
-  // align block
-  size_t toalloc = aligned_size(size + META_SIZE);
-  block* nb = sbrk(toalloc);
-  if ((ssize_t)nb == -1) {  // could not allocate more
+// as the last block in the list (it ends at heap_end).
+static block* new_block(arena* a, size_t size) {
+  // align block; the very first one may need some padding in front
+  size_t pad = a->first == NULL ? (BLOCK_OFFSET - (uintptr_t)arena_sbrk(a, 0)) & (ALIGNMENT - 1) : 0;
+  size_t toalloc = request_size(size);
+  uint8_t* mem = arena_sbrk(a, pad + toalloc);
+  if ((ssize_t)mem == -1) {  // could not allocate more
     errno = ENOMEM;
     return NULL;
   }
-  nb->is_free = false;  // not free
-  nb->next = sbrk(0);
+  block* nb = (block*)(mem + pad);
+  set_head(nb, toalloc, arena_bits(a) | (a->last != NULL && is_free(a->last) ? PREV_FREE_BIT : 0));
+  a->heap_end = block_next(nb);
+  a->last = nb;
+  a->stats.blocks++;
   return nb;
 }
 
+// The mapped blocks that are live, so that a pointer outside the heaps is
+// known to be one before its header is read: the header of a freed or
+// foreign pointer may well not be mapped. An open addressing hash set of
+// block pointers in a mapping of its own, kept under the lock of the main
+// arena like mapped_size.
+#define MAPPINGS_MIN (64)
+#define MAPPING_GONE ((block*)1) // slot of a removed entry
+static struct {
+  block** slots;
+  size_t capacity; // a power of two, 0 until the first mapped block
+  size_t used; // slots that are not empty, removed entries included
+} mappings;
+
+// first slot to look for pb in, the next ones follow
+static size_t mapping_slot(block* pb) {
+  uint64_t h = (uint64_t)(uintptr_t)pb * 0x9e3779b97f4a7c15ull;
+  return (h ^ (h >> 32)) & (mappings.capacity - 1);
+}
+
+static bool mappings_has(block* pb) {
+  if (mappings.capacity == 0) return false;
+  for (size_t i = mapping_slot(pb); mappings.slots[i] != NULL; i = (i + 1) & (mappings.capacity - 1)) {
+    if (mappings.slots[i] == pb) return true;
+  }
+  return false;
+}
+
+// Makes sure there is room for one more entry, growing the set (and
+// dropping the removed entries) at half full. Returns false if there is no
+// memory for that.
+static bool mappings_reserve() {
+  if (2 * (mappings.used + 1) <= mappings.capacity) return true;
+  size_t live = 0;
+  for (size_t i = 0; i < mappings.capacity; i++) live += mappings.slots[i] > MAPPING_GONE;
+  size_t capacity = mappings.capacity < MAPPINGS_MIN ? MAPPINGS_MIN : mappings.capacity;
+  while (4 * (live + 1) > capacity) capacity *= 2;
+  block** slots = mmap(NULL, capacity * sizeof(block*), PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (slots == MAP_FAILED) return false;
+  block** old = mappings.slots;
+  size_t old_capacity = mappings.capacity;
+  mappings.slots = slots;
+  mappings.capacity = capacity;
+  mappings.used = live;
+  for (size_t i = 0; i < old_capacity; i++) {
+    if (old[i] <= MAPPING_GONE) continue;
+    size_t j = mapping_slot(old[i]);
+    while (slots[j] != NULL) j = (j + 1) & (capacity - 1);
+    slots[j] = old[i];
+  }
+  if (old != NULL) munmap(old, old_capacity * sizeof(block*));
+  return true;
+}
+
+// Adds pb, after mappings_reserve() made room for it.
+static void mappings_add(block* pb) {
+  size_t i = mapping_slot(pb);
+  while (mappings.slots[i] != NULL) i = (i + 1) & (mappings.capacity - 1);
+  mappings.slots[i] = pb;
+  mappings.used++;
+}
+
+static void mappings_remove(block* pb) {
+  if (mappings.capacity == 0) return;
+  for (size_t i = mapping_slot(pb); mappings.slots[i] != NULL; i = (i + 1) & (mappings.capacity - 1)) {
+    if (mappings.slots[i] == pb) {
+      mappings.slots[i] = MAPPING_GONE;
+      return;
+    }
+  }
+}
+
 // Finds the block associated with data pointer ptr.
 // If there is no such block returns NULL.
+// Instead of walking the list, checks in constant time that ptr is aligned,
+// that its header lies inside the heap of an arena, carries the magic value
+// and the index of that arena, and is consistent with the end of its heap.
+// Outside the heaps, ptr can only belong to a live mapped block, whose data
+// starts ALIGNMENT bytes into a page, or, if it was aligned further, a power
+// of two bytes in or at the start of a page, see map_aligned(). Its header
+// is only read once the set of mappings has it: at the start of a page, it
+// sits in the page before, which need not be mapped.
 static block* find_block(void* ptr) {
-  if(first == NULL) return NULL;
-  block* tofind = data_to_block(ptr);
-  void* last_addr = sbrk(0);
-  for(block* pb = first; pb != last_addr; pb = pb->next) {
-    if(pb == tofind) return pb;
+  if((uintptr_t)ptr % ALIGNMENT != 0) return NULL;
+  block* pb = data_to_block(ptr);
+  arena* a = arenas;
+  while(a < arenas + MM_ARENAS && (a->first == NULL || pb < a->first || ptr >= a->heap_end)) a++;
+  if(a == arenas + MM_ARENAS) {
+    // a cheap check first, to keep most foreign pointers away from the lock
+    uintptr_t offset = (uintptr_t)ptr % page_size();
+    if((offset & (offset - 1)) != 0) return NULL;
+    LOCK(main_arena);
+    bool live = mappings_has(pb);
+    UNLOCK(main_arena);
+    if(!live || !has_magic(pb) || !is_mapped(pb)) return NULL;
+    return pb;
   }
-  return NULL;
+  if(!has_magic(pb) || is_mapped(pb) || block_arena(pb) != a) return NULL;
+  if(block_total_size(pb) < MIN_BLOCK_SIZE || (void*)block_next(pb) > a->heap_end) return NULL;
+  return pb;
+}
+
+// Writes the boundary tag of pb: the footer if pb is free, and the
+// PREV_FREE_BIT of the block following it.
+// Must be called whenever pb changes size or becomes free/used.
+static void update_tag(arena* a, block* pb) {
+  block* pn = block_next(pb);
+  if (is_free(pb)) ((uint64_t*)pn)[-1] = block_total_size(pb);
+  if (pn != a->heap_end) set_flag(pn, PREV_FREE_BIT, is_free(pb));
+}
+
+/*
+  The tree of big free blocks is a red-black tree ordered by size, then by
+  address, so that lookups, insertions and removals take O(log n) and the
+  best fit is the leftmost block big enough.
+ */
+
+static bool tree_red(block* pb) {
+  return pb != NULL && tree_of(pb)->red;
+}
+
+// true if block p comes before q in the tree
+static bool tree_less(block* p, block* q) {
+  size_t sp = block_total_size(p), sq = block_total_size(q);
+  return sp < sq || (sp == sq && p < q);
+}
+
+// Puts block pb where block old was in the tree, as child of its parent.
+static void tree_replace(arena* a, block* old, block* pb) {
+  block* parent = tree_of(old)->parent;
+  if (parent == NULL) a->tree = pb;
+  else tree_of(parent)->child[tree_of(parent)->child[1] == old] = pb;
+  if (pb != NULL) tree_of(pb)->parent = parent;
+}
+
+// Rotates the tree at pb, moving pb down to its dir side (0 for left) and
+// its child on the other side up.
+static void tree_rotate(arena* a, block* pb, int dir) {
+  tree_links* n = tree_of(pb);
+  block* up = n->child[!dir];
+  tree_links* u = tree_of(up);
+  n->child[!dir] = u->child[dir];
+  if (u->child[dir] != NULL) tree_of(u->child[dir])->parent = pb;
+  tree_replace(a, pb, up);
+  u->child[dir] = pb;
+  n->parent = up;
+}
+
+// Adds the free block pb to the tree.
+static void tree_insert(arena* a, block* pb) {
+  tree_links* n = tree_of(pb);
+  block* parent = NULL;
+  int dir = 0;
+  for (block* pc = a->tree; pc != NULL; pc = tree_of(pc)->child[dir]) {
+    parent = pc;
+    dir = tree_less(pc, pb);
+  }
+  n->child[0] = n->child[1] = NULL;
+  n->parent = parent;
+  n->red = true;
+  if (parent == NULL) a->tree = pb;
+  else tree_of(parent)->child[dir] = pb;
+
+  // a red block may not have a red parent
+  block* p;
+  while ((p = tree_of(pb)->parent) != NULL && tree_red(p)) {
+    block* g = tree_of(p)->parent;
+    int side = tree_of(g)->child[1] == p;
+    block* uncle = tree_of(g)->child[!side];
+    if (tree_red(uncle)) {
+      tree_of(p)->red = false;
+      tree_of(uncle)->red = false;
+      tree_of(g)->red = true;
+      pb = g;
+      continue;
+    }
+    if (tree_of(p)->child[!side] == pb) {
+      tree_rotate(a, p, side);
+      pb = p;
+      p = tree_of(pb)->parent;
+    }
+    tree_of(p)->red = false;
+    tree_of(g)->red = true;
+    tree_rotate(a, g, !side);
+  }
+  tree_of(a->tree)->red = false;
+}
+
+// Takes the free block pb out of the tree.
+static void tree_remove(arena* a, block* pb) {
+  tree_links* n = tree_of(pb);
+  bool removed_red = n->red;
+  block* x; // takes the place of the block removed from its spot
+  block* xp; // and its parent
+  if (n->child[0] == NULL || n->child[1] == NULL) {
+    x = n->child[n->child[0] == NULL];
+    xp = n->parent;
+    tree_replace(a, pb, x);
+  } else {
+    // the next block in order takes the spot of pb
+    block* y = n->child[1];
+    while (tree_of(y)->child[0] != NULL) y = tree_of(y)->child[0];
+    tree_links* yn = tree_of(y);
+    removed_red = yn->red;
+    x = yn->child[1];
+    if (yn->parent == pb) {
+      xp = y;
+    } else {
+      xp = yn->parent;
+      tree_replace(a, y, x);
+      yn->child[1] = n->child[1];
+      tree_of(yn->child[1])->parent = y;
+    }
+    tree_replace(a, pb, y);
+    yn->child[0] = n->child[0];
+    tree_of(yn->child[0])->parent = y;
+    yn->red = n->red;
+  }
+  if (removed_red) return;
+
+  // the paths through x lack a black block
+  while (x != a->tree && !tree_red(x)) {
+    int side = tree_of(xp)->child[1] == x;
+    block* w = tree_of(xp)->child[!side];
+    if (tree_red(w)) {
+      tree_of(w)->red = false;
+      tree_of(xp)->red = true;
+      tree_rotate(a, xp, side);
+      w = tree_of(xp)->child[!side];
+    }
+    if (!tree_red(tree_of(w)->child[0]) && !tree_red(tree_of(w)->child[1])) {
+      tree_of(w)->red = true;
+      x = xp;
+      xp = tree_of(x)->parent;
+      continue;
+    }
+    if (!tree_red(tree_of(w)->child[!side])) {
+      tree_of(tree_of(w)->child[side])->red = false;
+      tree_of(w)->red = true;
+      tree_rotate(a, w, !side);
+      w = tree_of(xp)->child[!side];
+    }
+    tree_of(w)->red = tree_of(xp)->red;
+    tree_of(xp)->red = false;
+    tree_of(tree_of(w)->child[!side])->red = false;
+    tree_rotate(a, xp, side);
+    x = a->tree;
+  }
+  if (x != NULL) tree_of(x)->red = false;
+}
+
+// Returns the smallest free block in the tree of at least size bytes, the
+// one at the lowest address if there are several, or NULL.
+static block* tree_fit(arena* a, size_t size) {
+  block* best = NULL;
+  for (block* pb = a->tree; pb != NULL; ) {
+    if (block_total_size(pb) >= size) {
+      best = pb;
+      pb = tree_of(pb)->child[0];
+    } else {
+      pb = tree_of(pb)->child[1];
+    }
+  }
+  return best;
+}
+
+// the block after pb in the tree, or NULL
+static block* tree_next(block* pb) {
+  if (tree_of(pb)->child[1] != NULL) {
+    pb = tree_of(pb)->child[1];
+    while (tree_of(pb)->child[0] != NULL) pb = tree_of(pb)->child[0];
+    return pb;
+  }
+  block* p = tree_of(pb)->parent;
+  while (p != NULL && tree_of(p)->child[1] == pb) {
+    pb = p;
+    p = tree_of(p)->parent;
+  }
+  return p;
+}
+
+// Adds the free block pb to the head of the free list of its size class, or
+// to the tree if it is big.
+static void list_insert(arena* a, block* pb) {
+  unsigned cls = size_class(block_total_size(pb));
+  if (cls >= TREE_CLASS) {
+    tree_insert(a, pb);
+  } else {
+    free_links* pl = block_links(pb);
+    pl->prev_free = NULL;
+    pl->next_free = a->free_lists[cls];
+    if (a->free_lists[cls] != NULL) block_links(a->free_lists[cls])->prev_free = pb;
+    a->free_lists[cls] = pb;
+    a->free_map |= 1u << cls;
+  }
+  a->stats.free += block_total_size(pb);
+  a->stats.free_blocks++;
+  a->stats.free_by_class[cls]++;
+}
+
+// Unlinks the free block pb from its free list, or from the tree.
+// Note: must be called before the size of pb changes
+static void list_remove(arena* a, block* pb) {
+  unsigned cls = size_class(block_total_size(pb));
+  if (cls >= TREE_CLASS) {
+    tree_remove(a, pb);
+  } else {
+    free_links* pl = block_links(pb);
+    if (pl->prev_free != NULL) block_links(pl->prev_free)->next_free = pl->next_free;
+    else a->free_lists[cls] = pl->next_free;
+    if (pl->next_free != NULL) block_links(pl->next_free)->prev_free = pl->prev_free;
+    if (a->free_lists[cls] == NULL) a->free_map &= ~(1u << cls);
+  }
+  a->stats.free -= block_total_size(pb);
+  a->stats.free_blocks--;
+  a->stats.free_by_class[cls]--;
+}
+
+// Merges block pb with the block following it, if that one is free.
+// Note: pb must not be in a free list
+static void merge_next(arena* a, block* pb) {
+  block* pn = block_next(pb);
+  if (pn == a->heap_end || !is_free(pn)) return;
+  list_remove(a, pn);
+  set_size(pb, block_total_size(pb) + block_total_size(pn));
+  pn->head = 0; // no longer a block
+  a->stats.blocks--;
+  a->stats.merges++;
+  if (a->rover == pn) a->rover = pb;
+  if (a->last == pn) a->last = pb;
+  update_tag(a, pb);
 }
 
 // Splits block pb in two: first one as big as size, the second as big as the
 // rest here size must be smaller than the current block size.
-// The second block is marked as free.
-// Note: does not check for valid input block
-static ssize_t split_block(block* pb, size_t size) {
-  ssize_t rest = block_data_size(pb) - aligned_size(size + META_SIZE);
-  if (rest >= 0) {
+// The second block is marked as free, merged with a free block following it
+// and put in its free list, unless it would be smaller than MIN_BLOCK_SIZE.
+// Note: does not check for valid input block, pb must not be in a free list
+static ssize_t split_block(arena* a, block* pb, size_t size) {
+  size_t keep = request_size(size);
+  ssize_t rest = (ssize_t)block_total_size(pb) - (ssize_t)keep - (ssize_t)META_SIZE;
+  if (rest + (ssize_t)META_SIZE >= (ssize_t)MIN_BLOCK_SIZE) {
     // can add another block
-    block* pn = (block*)((uint8_t*)pb + aligned_size(size + META_SIZE));
-    pn->next = pb->next;
-    pn->is_free = true;
-    pb->next = pn;
+    block* pn = (block*)((uint8_t*)pb + keep);
+    set_head(pn, rest + META_SIZE, FREE_BIT | arena_bits(a));
+    set_size(pb, keep);
+    a->stats.blocks++;
+    a->stats.splits++;
+    if (a->last == pb) a->last = pn;
+    update_tag(a, pb);
+    merge_next(a, pn);
+    update_tag(a, pn);
+    list_insert(a, pn);
   }
   return rest;
 }
 
-// Merges all free adjacent blocks in the list, starting at block pb.
-// Note: does not check for valid input block
-static void merge_blocks(block* pb) {
-  void* last_addr = sbrk(0);
-  if(pb == NULL || pb == last_addr) return;
-  while (pb->next != last_addr) { // while there is a next
-    block* pn = pb->next;
-    if (pb->is_free && pn->is_free) {
-      // can merge
-      pb->next = pn->next;
-    } else {
-      // move to next
-      pb = pn;
+// Merges the free block pb with its free neighbours on both sides. The
+// boundary tags give the previous block directly, and as neighbours are
+// merged on every free there is at most one free block on each side, so
+// this takes constant time.
+// Returns the merged block, which is not in any free list.
+// Note: does not check for valid input block, pb must not be in a free list
+static block* merge_blocks(arena* a, block* pb) {
+  merge_next(a, pb);
+  if (pb->head & PREV_FREE_BIT) {
+    block* pp = prev_block(pb);
+    list_remove(a, pp);
+    set_size(pp, block_total_size(pp) + block_total_size(pb));
+    pb->head = 0; // no longer a block
+    a->stats.blocks--;
+    a->stats.merges++;
+    if (a->rover == pb) a->rover = pp;
+    if (a->last == pb) a->last = pp;
+    pb = pp;
+  }
+  update_tag(a, pb);
+  return pb;
+}
+
+// Walks the heap from block start, wrapping around at its end, for the first
+// free block of at least size bytes. Returns NULL if there is none.
+static block* heap_fit(arena* a, block* start, size_t size) {
+  block* pb = start;
+  do {
+    if (is_free(pb) && block_total_size(pb) >= size) return pb;
+    pb = block_next(pb);
+    if (pb == a->heap_end) pb = a->first;
+  } while (pb != start);
+  return NULL;
+}
+
+// Returns the smallest free block of at least size bytes, or NULL. The size
+// classes hold ever larger blocks, so only the first class with a block big
+// enough needs to be searched through, and the tree has the big ones in
+// order.
+static block* best_fit(arena* a, size_t size) {
+  block* best = NULL;
+  for (unsigned m = a->free_map & ~((1u << size_class(size)) - 1); m != 0 && best == NULL; m &= m - 1) {
+    for (block* pb = a->free_lists[__builtin_ctz(m)]; pb != NULL; pb = block_links(pb)->next_free) {
+      size_t sz = block_total_size(pb);
+      if (sz >= size && (best == NULL || sz < block_total_size(best))) best = pb;
+    }
+  }
+  return best != NULL ? best : tree_fit(a, size);
+}
+
+// Returns the first block of at least size bytes in the size class of the
+// request, else any block of the next non-empty larger class, else the best
+// fit from the tree, or NULL. This is close to best fit at the cost of a
+// single list search.
+static block* good_fit(arena* a, size_t size) {
+  unsigned cls = size_class(size);
+  for(block* pb = a->free_lists[cls]; pb != NULL; pb = block_links(pb)->next_free){
+    if(block_total_size(pb) >= size){
+      return pb;
     }
   }
+  // first non-empty list of a larger class
+  unsigned larger = a->free_map & ~((2u << cls) - 1);
+  if(larger == 0) return tree_fit(a, size);
+  return a->free_lists[__builtin_ctz(larger)];
+}
+
+// Picks the placement policy from the MM_FIT environment variable, or keeps
+// the one chosen at build time if it is not set to a known policy.
+static void choose_fit() {
+  static const char* names[] = {"good", "first", "next", "best"};
+  const char* env = getenv("MM_FIT");
+  fit = MM_FIT;
+  for (unsigned i = 0; env != NULL && i < sizeof(names) / sizeof(names[0]); i++) {
+    if (strcmp(env, names[i]) == 0) fit = (enum fit_policy)i;
+  }
+}
+
+// Applies the settings from the environment, see "Build options".
+static void setup_from_env() {
+  choose_fit();
+  const char* sig = getenv("MM_STATS_SIGNAL");
+  const char* path = getenv("MM_STATS_FILE");
+  if (sig != NULL && path != NULL) stats_on_signal(atoi(sig), path);
+}
+
+#ifdef MM_THREADS
+static pthread_once_t env_once = PTHREAD_ONCE_INIT;
+#else
+static bool env_done = false;
+#endif
+
+// Runs setup_from_env() the first time it is called only, so that neither
+// other arenas nor reset() change the policy under running threads, nor
+// replace a signal handler the program installed in the meantime.
+static void setup_once() {
+#ifdef MM_THREADS
+  pthread_once(&env_once, setup_from_env);
+#else
+  if (!env_done) {
+    env_done = true;
+    setup_from_env();
+  }
+#endif
+}
+
+// Finds a free block of at least given_size bytes (total size) in arena a
+// with the placement policy in use:
+//   FIT_GOOD   see good_fit()
+//   FIT_FIRST  the free block at the lowest address
+//   FIT_NEXT   like FIT_FIRST, but going on from the block found last time
+//   FIT_BEST   the smallest one, see best_fit()
+// Returns NULL if there is none.
+block* find_free_block(arena* a, size_t given_size){
+  if(a->free_map == 0 && a->tree == NULL) return NULL;
+  switch(fit){
+  case FIT_FIRST:
+    return heap_fit(a, a->first, given_size);
+  case FIT_NEXT: {
+    block* pb = heap_fit(a, a->rover != NULL ? a->rover : a->first, given_size);
+    if(pb != NULL) a->rover = pb;
+    return pb;
+  }
+  case FIT_BEST:
+    return best_fit(a, given_size);
+  default:
+    return good_fit(a, given_size);
+  }
 }
 /* end of List level operations */
 
-/* ------ Your assignment starts HERE! ------- */
+/*
+  Heap level operations, used by the allocation functions. They work on the
+  heap of arena a; in the thread-safe build the caller must hold its lock.
+ */
+
+// Allocates an occupied block with room for size bytes of data, reusing a
+// free block if there is one big enough.
+static block* heap_alloc(arena* a, size_t size) {
+  if(a->first == NULL) setup_once();
+  block* found = find_free_block(a, request_size(size));
+  if(found != NULL){
+    list_remove(a, found);
+    set_flag(found, FREE_BIT, false);
+    update_tag(a, found);
+    split_block(a, found, size);
+    return found;
+  }
+
+  // tough luck: need more memory. A free block at the top is grown instead
+  // of adding a new block next to it
+  if(a->last != NULL && is_free(a->last)) {
+    block* top = a->last;
+    size_t more = request_size(size) - block_total_size(top);
+    if((ssize_t)arena_sbrk(a, more) == -1) {
+      errno = ENOMEM;
+      return NULL;
+    }
+    list_remove(a, top);
+    set_size(top, block_total_size(top) + more);
+    set_flag(top, FREE_BIT, false);
+    a->heap_end = block_next(top);
+    return top;
+  }
+  block* nb = new_block(a, size);
+  if(nb == NULL) return NULL;
+  if(a->first == NULL) a->first = nb;
+  return nb;
+}
+
+// Where the header of a block with data aligned to alignment, a power of two
+// above ALIGNMENT, goes in the free block pb: leaving either nothing in front
+// of it or enough for a free block. As alignment is at least twice
+// ALIGNMENT, one more step makes sure the slack is big enough.
+static block* aligned_header(block* pb, size_t alignment) {
+  uintptr_t data = (uintptr_t)block_to_data(pb);
+  uintptr_t aligned = (data + alignment - 1) & ~(alignment - 1);
+  if(aligned != data && aligned - data < MIN_BLOCK_SIZE) aligned += alignment;
+  return data_to_block((void*)aligned);
+}
+
+// Finds a free block with room for a block of total size total with data
+// aligned to alignment, and stores the header of that block in *spot.
+// Returns NULL if there is none.
+static block* find_aligned_block(arena* a, size_t alignment, size_t total, block** spot) {
+  for(unsigned m = a->free_map & ~((1u << size_class(total)) - 1); m != 0; m &= m - 1) {
+    for(block* pb = a->free_lists[__builtin_ctz(m)]; pb != NULL; pb = block_links(pb)->next_free) {
+      block* nb = aligned_header(pb, alignment);
+      if((uint8_t*)nb + total <= (uint8_t*)block_next(pb)) {
+        *spot = nb;
+        return pb;
+      }
+    }
+  }
+  for(block* pb = tree_fit(a, total); pb != NULL; pb = tree_next(pb)) {
+    block* nb = aligned_header(pb, alignment);
+    if((uint8_t*)nb + total <= (uint8_t*)block_next(pb)) {
+      *spot = nb;
+      return pb;
+    }
+  }
+  return NULL;
+}
+
+// Allocates a block with data aligned to alignment, a power of two above
+// ALIGNMENT. The block is carved out of a free block, which keeps the slack
+// in front of it; if none has room, the free block at the top of the heap
+// (made if needed) is grown by just what it lacks.
+static block* heap_alloc_aligned(arena* a, size_t alignment, size_t size) {
+  size_t total = request_size(size);
+  block* nb = NULL;
+  block* pb = find_aligned_block(a, alignment, total, &nb);
+  if(pb == NULL) {
+    if(a->last == NULL || !is_free(a->last)) {
+      block* top = new_block(a, 0);
+      if(top == NULL) return NULL;
+      if(a->first == NULL) a->first = top;
+      set_flag(top, FREE_BIT, true);
+      update_tag(a, top);
+      list_insert(a, top);
+    }
+    pb = a->last;
+    nb = aligned_header(pb, alignment);
+    size_t more = (uint8_t*)nb + total - (uint8_t*)a->heap_end;
+    if((ssize_t)arena_sbrk(a, more) == -1) {
+      errno = ENOMEM;
+      return NULL;
+    }
+    list_remove(a, pb);
+    set_size(pb, block_total_size(pb) + more);
+    a->heap_end = block_next(pb);
+    update_tag(a, pb);
+    list_insert(a, pb);
+  }
+
+  list_remove(a, pb);
+  if(nb == pb) {
+    set_flag(pb, FREE_BIT, false);
+  } else {
+    // pb keeps the slack, between an occupied block and nb
+    size_t lead = (uint8_t*)nb - (uint8_t*)pb;
+    set_head(nb, block_total_size(pb) - lead, arena_bits(a));
+    set_size(pb, lead);
+    a->stats.blocks++;
+    a->stats.splits++;
+    if(a->last == pb) a->last = nb;
+    list_insert(a, pb);
+  }
+  update_tag(a, pb);
+  update_tag(a, nb);
+  split_block(a, nb, size);
+  return nb;
+}
+
+// Gives free memory at the top of the heap back to the system, once the free
+// block there has grown to TRIM_THRESHOLD. Keeps TOP_PAD bytes of it (rounded
+// up to just before a page boundary, where blocks end) for the allocations
+// to come.
+static void trim_heap(arena* a) {
+  block* last = a->last;
+  if(last == NULL || !is_free(last)) return;
+  if(block_total_size(last) < TRIM_THRESHOLD) return;
+  size_t keep = aligned_size(TOP_PAD) < MIN_BLOCK_SIZE ? MIN_BLOCK_SIZE : aligned_size(TOP_PAD);
+  uintptr_t new_end = ((uintptr_t)last + keep + BLOCK_OFFSET + page_size() - 1) & ~(page_size() - 1);
+  new_end -= BLOCK_OFFSET;
+  if(new_end >= (uintptr_t)a->heap_end) return;
+  if((ssize_t)arena_sbrk(a, -(intptr_t)((uintptr_t)a->heap_end - new_end)) == -1) return;
+  list_remove(a, last);
+  a->heap_end = (void*)new_end;
+  set_size(last, new_end - (uintptr_t)last);
+  update_tag(a, last);
+  list_insert(a, last);
+}
+
+// Gives the occupied block pb back to the free lists.
+static void heap_free(arena* a, block* pb) {
+  set_flag(pb, FREE_BIT, true);
+  list_insert(a, merge_blocks(a, pb));
+  trim_heap(a);
+}
+
+// Tries to resize the occupied block pb in place to hold size bytes, taking
+// in the free block after it and, at the top of the heap, more memory from
+// arena_sbrk(). As free blocks are always merged, there is at most one free
+// block to take in.
+// Returns false if pb cannot grow that much where it is.
+static bool heap_resize(arena* a, block* pb, size_t size) {
+  // Current block is big enough: shrink it and give the rest back
+  if(block_data_size(pb) >= size) {
+    split_block(a, pb, size);
+    trim_heap(a);
+    return true;
+  }
+
+  // if the following block is free and big enough together with this one,
+  // grow the block in place and split off whatever is left
+  size_t needed = request_size(size);
+  size_t avail = block_total_size(pb);
+  block* nextBlock = block_next(pb);
+  if(nextBlock != a->heap_end && is_free(nextBlock)) avail += block_total_size(nextBlock);
+  if(avail >= needed) {
+    merge_next(a, pb);
+    split_block(a, pb, size);
+    return true;
+  }
+
+  // if nothing but free space follows the block, grow the top of the heap
+  if(nextBlock == a->heap_end || (is_free(nextBlock) && nextBlock == a->last)) {
+    if((ssize_t)arena_sbrk(a, needed - avail) == -1) return false;
+    merge_next(a, pb);
+    set_size(pb, needed);
+    a->heap_end = block_next(pb);
+    return true;
+  }
+  return false;
+}
+/* end of Heap level operations */
 
 /*
-Finds the total size allocated by all blocks linked starting with the block
-indicated by starting.
-*/
-size_t total_size_deallocate(block* starting) {
-  size_t total_block_size;
-  for(block* start = starting; start != sbrk(0); start=start->next){
-    total_block_size += block_total_size(start);
+  Mapped blocks: big blocks that get a mapping of their own, so that they can
+  be given back to the system as soon as they are freed.
+ */
+
+// Length of a mapping for a mapped block with room for size bytes of data.
+// The header is placed BLOCK_OFFSET bytes into the mapping, so that the data
+// is aligned, and the block stops BLOCK_OFFSET bytes short of its end, so
+// that its size stays a multiple of ALIGNMENT.
+static size_t mapping_size(size_t size) {
+  return (size + META_SIZE + 2 * BLOCK_OFFSET + page_size() - 1) & ~(page_size() - 1);
+}
+
+// Start of the mapping of the mapped block pb: the page holding the word
+// BLOCK_OFFSET bytes before its header.
+static uint8_t* mapping_start(block* pb) {
+  return (uint8_t*)(((uintptr_t)pb - BLOCK_OFFSET) & ~(page_size() - 1));
+}
+
+// Counts in the new mapped block pb, which ends BLOCK_OFFSET bytes short of
+// its mapping. Returns NULL, having given the mapping back, if there is no
+// memory to keep track of it.
+static block* add_mapped(block* pb) {
+  LOCK(main_arena);
+  bool room = mappings_reserve();
+  if (room) {
+    mappings_add(pb);
+    mapped_size += block_data_size(pb);
+  }
+  UNLOCK(main_arena);
+  if (!room) {
+    uint8_t* mem = mapping_start(pb);
+    munmap(mem, (uint8_t*)block_next(pb) + BLOCK_OFFSET - mem);
+    errno = ENOMEM;
+    return NULL;
+  }
+  return pb;
+}
+
+// Allocates a mapped block with room for size bytes of data.
+static block* map_block(size_t size) {
+  size_t len = mapping_size(size);
+  uint8_t* mem = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  block* pb = (block*)(mem + BLOCK_OFFSET);
+  set_head(pb, len - 2 * BLOCK_OFFSET, MAPPED_BIT);
+  return add_mapped(pb);
+}
+
+// Allocates a mapped block with room for size bytes of data aligned to
+// alignment, a power of two above ALIGNMENT. Maps alignment bytes more than
+// needed and gives back the whole pages in front of the block and past it,
+// so that the header may sit anywhere in the first page left.
+static block* map_aligned(size_t alignment, size_t size) {
+  size_t len = mapping_size(size + alignment);
+  uint8_t* mem = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  uintptr_t data = ((uintptr_t)mem + ALIGNMENT + alignment - 1) & ~(alignment - 1);
+  block* pb = data_to_block((void*)data);
+  uint8_t* start = mapping_start(pb);
+  uint8_t* end = (uint8_t*)page_up(data + size + BLOCK_OFFSET);
+  if (start > mem) munmap(mem, start - mem);
+  if (end < mem + len) munmap(end, mem + len - end);
+  set_head(pb, end - BLOCK_OFFSET - (uint8_t*)pb, MAPPED_BIT);
+  return add_mapped(pb);
+}
+
+// Gives the mapped block pb back to the system.
+static void unmap_block(block* pb) {
+  LOCK(main_arena);
+  mappings_remove(pb);
+  mapped_size -= block_data_size(pb);
+  UNLOCK(main_arena);
+  uint8_t* mem = mapping_start(pb);
+  munmap(mem, (uint8_t*)block_next(pb) + BLOCK_OFFSET - mem);
+}
+
+// Resizes the mapped block pb to hold size bytes of data. The block may move,
+// but the kernel moves the pages instead of copying the data where it can.
+// Returns NULL if there is no memory, then pb is left as it was.
+static block* remap_block(block* pb, size_t size) {
+  uint8_t* mem = mapping_start(pb);
+  // where the header sits in the mapping, further in for aligned blocks
+  size_t skip = (uint8_t*)pb - mem;
+  size_t len = (uint8_t*)block_next(pb) + BLOCK_OFFSET - mem;
+  size_t newlen = mapping_size(size + skip - BLOCK_OFFSET);
+  if (newlen == len) return pb;
+  // the lock is held throughout, so that the room made for the moved block
+  // in the set of mappings is still there once it has moved
+  LOCK(main_arena);
+  if (!mappings_reserve()) {
+    UNLOCK(main_arena);
+    errno = ENOMEM;
+    return NULL;
+  }
+#ifdef MREMAP_MAYMOVE
+  uint8_t* nmem = mremap(mem, len, newlen, MREMAP_MAYMOVE);
+#else
+  uint8_t* nmem = mmap(NULL, newlen, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (nmem != MAP_FAILED) {
+    memcpy(nmem, mem, len < newlen ? len : newlen);
+    munmap(mem, len);
+  }
+#endif
+  if (nmem == MAP_FAILED) {
+    UNLOCK(main_arena);
+    errno = ENOMEM;
+    return NULL;
+  }
+  block* nb = (block*)(nmem + skip);
+  set_head(nb, newlen - skip - BLOCK_OFFSET, MAPPED_BIT);
+  mappings_remove(pb);
+  mappings_add(nb);
+  mapped_size += newlen - len;
+  UNLOCK(main_arena);
+  return nb;
+}
+/* end of Mapped blocks */
+
+/*
+  Arenas. A thread allocates from one arena, picked the first time it needs
+  one: the first thread gets the main arena, the others are spread over all
+  arenas by the CPU they run on, or round-robin with MM_ARENA=rr. A block
+  goes back to the arena in its header, whichever thread frees it.
+  Arenas other than the main one reserve ARENA_SIZE bytes of address space,
+  which their heap grows into; once one is full, the main arena takes over.
+ */
+
+#ifdef MM_THREADS
+static pthread_once_t arenas_once = PTHREAD_ONCE_INIT;
+
+// fork() handlers, so that the child does not inherit an arena locked by a
+// thread it does not have
+static void fork_prepare() {
+  for (arena* a = arenas; a < arenas + MM_ARENAS; a++) LOCK(a);
+}
+
+static void fork_done() {
+  for (arena* a = arenas; a < arenas + MM_ARENAS; a++) UNLOCK(a);
+}
+
+static void arenas_init() {
+  const char* env = getenv("MM_ARENA");
+  if (env != NULL && strcmp(env, "rr") == 0) arena_pick = PICK_ROUND_ROBIN;
+  pthread_atfork(fork_prepare, fork_done, fork_done);
+}
+#endif
+
+// The arena of the calling thread.
+static arena* thread_arena() {
+#ifdef MM_THREADS
+  if (my_arena == NULL) {
+    pthread_once(&arenas_once, arenas_init);
+    unsigned i = __atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED);
+    int cpu = sched_getcpu();
+    if (i > 0 && arena_pick == PICK_CPU && cpu >= 0) i = cpu;
+    my_arena = &arenas[i % MM_ARENAS];
+  }
+  return my_arena;
+#else
+  return main_arena;
+#endif
+}
+
+// Gives the occupied heap block pb back to its arena.
+static void arena_free(block* pb) {
+  arena* a = block_arena(pb);
+  LOCK(a);
+  heap_free(a, pb);
+  UNLOCK(a);
+}
+/* end of Arenas */
+
+#ifdef MM_THREADS
+/*
+  Thread cache operations. These work on the cache of the calling thread and
+  only take the lock of an arena to move a batch of blocks to or from it.
+ */
+
+// Gives the n cached blocks in batch back to their arenas, taking the lock
+// of each arena once for all of its blocks.
+static void tcache_release(block** batch, unsigned n) {
+  while (n > 0) {
+    arena* a = block_arena(batch[0]);
+    unsigned rest = 0;
+    LOCK(a);
+    for (unsigned i = 0; i < n; i++) {
+      if (block_arena(batch[i]) == a) heap_free(a, batch[i]);
+      else batch[rest++] = batch[i];
+    }
+    UNLOCK(a);
+    n = rest;
+  }
+}
+
+// Takes n blocks off the cache list of class cls and gives them back.
+static void tcache_drop(tcache* tc, unsigned cls, unsigned n) {
+  block* batch[TCACHE_COUNT];
+  for (unsigned i = 0; i < n; i++) {
+    batch[i] = tc->bins[cls];
+    tc->bins[cls] = block_links(batch[i])->next_free;
+  }
+  tc->count[cls] -= n;
+  tcache_release(batch, n);
+}
+
+// Gives all the blocks cached by the exiting thread back to their arenas.
+static void tcache_flush(void* arg) {
+  tcache* tc = arg;
+  for (unsigned cls = 0; cls < SMALL_CLASSES; cls++) tcache_drop(tc, cls, tc->count[cls]);
+}
+
+static void tcache_init() {
+  pthread_key_create(&tcache_exit_key, tcache_flush);
+}
+
+// Takes a cached block of total size total, refilling the cache from the
+// free list of that size in the arena of the thread if it is empty. Returns
+// NULL if total is not a small size or there is no such block, then the
+// caller goes to the heap.
+static block* tcache_get(size_t total) {
+  if (total > SMALL_CLASSES * ALIGNMENT) return NULL;
+  tcache* tc = &thread_cache;
+  if (!tc->registered) {
+    tc->registered = true;
+    pthread_once(&tcache_once, tcache_init);
+    pthread_setspecific(tcache_exit_key, tc);
+  }
+
+  unsigned cls = size_class(total);
+  if (tc->bins[cls] == NULL) {
+    // small classes hold one block size only, so any block there will do
+    arena* a = thread_arena();
+    LOCK(a);
+    for (unsigned i = 0; i < TCACHE_BATCH && a->free_lists[cls] != NULL; i++) {
+      block* pb = a->free_lists[cls];
+      list_remove(a, pb);
+      set_flag(pb, FREE_BIT, false);
+      update_tag(a, pb);
+      block_links(pb)->prev_free = tcache_key();
+      block_links(pb)->next_free = tc->bins[cls];
+      tc->bins[cls] = pb;
+      tc->count[cls]++;
+    }
+    UNLOCK(a);
+    if (tc->bins[cls] == NULL) return NULL;
+  }
+
+  block* pb = tc->bins[cls];
+  tc->bins[cls] = block_links(pb)->next_free;
+  tc->count[cls]--;
+  block_links(pb)->prev_free = NULL;
+  return pb;
+}
+
+// true if the occupied block pb is in the cache of the calling thread,
+// i.e. it has been freed already
+static bool tcache_holds(block* pb) {
+  unsigned cls = size_class(block_total_size(pb));
+  if (cls >= SMALL_CLASSES || block_links(pb)->prev_free != tcache_key()) return false;
+  // probably a double free, make sure
+  for (block* pc = thread_cache.bins[cls]; pc != NULL; pc = block_links(pc)->next_free) {
+    if (pc == pb) return true;
+  }
+  return false;
+}
+
+// Puts the occupied block pb in the cache, flushing half of a full cache
+// list to the arenas first. Returns false if pb is not small enough to be
+// cached or has already been freed to the cache of this thread.
+static bool tcache_put(block* pb) {
+  unsigned cls = size_class(block_total_size(pb));
+  if (cls >= SMALL_CLASSES) return false;
+  tcache* tc = &thread_cache;
+  if (tcache_holds(pb)) return true;
+
+  if (tc->count[cls] >= TCACHE_COUNT) tcache_drop(tc, cls, TCACHE_BATCH);
+
+  block_links(pb)->prev_free = tcache_key();
+  block_links(pb)->next_free = tc->bins[cls];
+  tc->bins[cls] = pb;
+  tc->count[cls]++;
+  return true;
+}
+/* end of Thread cache operations */
+#endif
+
+/*
+  Allocation paths shared by the functions below.
+ */
+
+// Allocates a block with room for size bytes in arena a, see heap_alloc().
+// If the arena grew for it, the block ends at the top of the heap, and its
+// data from *zero up is memory the system just handed out.
+static block* arena_alloc(arena* a, size_t size, uint8_t** zero) {
+  LOCK(a);
+  void* old_end = a->heap_end;
+  block* pb = heap_alloc(a, size);
+  if(pb != NULL && a->heap_end != old_end && block_next(pb) == a->heap_end) *zero = a->fresh;
+  UNLOCK(a);
+  return pb;
+}
+
+// Maps a block of its own for size bytes, see map_block(). Its data is all
+// zero, as the mapping is fresh.
+static block* map_zeroed(size_t size, uint8_t** zero) {
+  block* pb = map_block(size);
+  if(pb != NULL) *zero = block_to_data(pb);
+  return pb;
+}
+
+// Allocates a block with room for size bytes: big blocks get a mapping of
+// their own, small ones come from the thread cache if it has any, the rest
+// from the arena of the thread. Zero bytes get the smallest block, so that
+// the pointer is unique and can be freed or resized like any other. Returns
+// NULL if there is no memory. Unless zero is NULL, stores in *zero where the
+// data known to be zero starts, or NULL if none is.
+static block* alloc_block(size_t size, uint8_t** zero) {
+  uint8_t* ignored;
+  if(zero == NULL) zero = &ignored;
+  *zero = NULL;
+  if(size > MAX_REQUEST) {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  // big blocks get a mapping of their own
+  if(size >= MMAP_THRESHOLD) return map_zeroed(size, zero);
+
+#ifdef MM_THREADS
+  block* cached = tcache_get(request_size(size));
+  if(cached != NULL) return cached;
+#endif
+  arena* a = thread_arena();
+  block* pb = arena_alloc(a, size, zero);
+  // the arena cannot grow: try the main arena, and if someone else moved the
+  // break, use a mapping
+  if(pb == NULL && a != main_arena) pb = arena_alloc(main_arena, size, zero);
+  if(pb == NULL) pb = map_zeroed(size, zero);
+  return pb;
+}
+
+// Allocates a block with data aligned to alignment, a power of two above
+// ALIGNMENT, like alloc_block(): big blocks get a mapping of their own, the
+// rest come from the arena of the thread, else the main arena, else a
+// mapping. Returns NULL if there is no memory.
+static block* alloc_aligned_block(size_t alignment, size_t size) {
+  if(size >= MMAP_THRESHOLD) return map_aligned(alignment, size);
+  arena* a = thread_arena();
+  LOCK(a);
+  block* pb = heap_alloc_aligned(a, alignment, size);
+  UNLOCK(a);
+  if(pb == NULL && a != main_arena) {
+    LOCK(main_arena);
+    pb = heap_alloc_aligned(main_arena, alignment, size);
+    UNLOCK(main_arena);
+  }
+  if(pb == NULL) pb = map_aligned(alignment, size);
+  return pb;
+}
+
+// Gives back the occupied block pb, wherever it came from.
+static void free_block(block* pb) {
+  if(is_mapped(pb)) {
+    unmap_block(pb);
+    return;
+  }
+#ifdef MM_THREADS
+  if(tcache_put(pb)) return;
+#endif
+  arena_free(pb);
+}
+/* end of Allocation paths */
+
+#ifdef MM_DEBUG
+/*
+  Debug mode. The data of every block starts with a debug_head, and the data
+  the caller asked for is followed by a tail canary. On free both canaries
+  are checked, the data is filled with FREE_FILL and the block is held back
+  in a quarantine; by the time it leaves the quarantine the fill is checked
+  again, which catches writes after free. Bad, double and corrupted frees
+  abort the program with a message on stderr.
+ */
+
+// bytes kept in quarantine before the oldest block is really freed
+#define QUARANTINE_BYTES (1024 * 1024)
+#define QUARANTINE_SLOTS (1024)
+#define HEAD_CANARY (0xc0ffee11u)
+#define FREED_CANARY (0xdeadf4eeu) // head canary of a quarantined block
+#define TAIL_CANARY (0x5afe7a11c0ffee55ull)
+#define ALLOC_FILL (0xaa) // fresh memory, to make reads of it stand out
+#define FREE_FILL (0xdd)
+
+// Sits right before the data handed out.
+typedef struct debug_head_s {
+  uint64_t size; // asked for by the caller
+  uint32_t offset; // from the start of the data of the block to the data handed out
+  uint32_t canary;
+} debug_head;
+
+// data of freed blocks waiting to be reused, oldest first
+static struct {
+  void* slots[QUARANTINE_SLOTS];
+  unsigned start, count;
+  size_t bytes;
+} quarantine;
+
+static debug_head* debug_head_of(void* ptr) {
+  return (debug_head*)ptr - 1;
+}
+
+// Writes what went wrong to stderr and aborts. Uses write() only, as the
+// heap can not be trusted anymore.
+static void debug_fail(const char* what, const char* problem, void* ptr) {
+  char hex[2 + 2 * sizeof(uintptr_t) + 1];
+  uintptr_t v = (uintptr_t)ptr;
+  hex[0] = '0';
+  hex[1] = 'x';
+  for (unsigned i = 0; i < 2 * sizeof(uintptr_t); i++) {
+    hex[2 + i] = "0123456789abcdef"[(v >> (4 * (2 * sizeof(uintptr_t) - 1 - i))) & 0xf];
+  }
+  hex[sizeof(hex) - 1] = '\n';
+  const char* parts[] = {"ll-mm: ", what, "(): ", problem, " at "};
+  for (unsigned i = 0; i < sizeof(parts) / sizeof(parts[0]); i++) {
+    ssize_t ignored = write(STDERR_FILENO, parts[i], strlen(parts[i]));
+    (void)ignored;
+  }
+  ssize_t ignored = write(STDERR_FILENO, hex, sizeof(hex));
+  (void)ignored;
+  abort();
+}
+
+// Sets up the canaries of block pb, handing out size bytes at offset from
+// the start of its data.
+static void* debug_arm(block* pb, size_t offset, size_t size) {
+  if(pb == NULL) return NULL;
+  uint8_t* ptr = (uint8_t*)block_to_data(pb) + offset;
+  debug_head* h = debug_head_of(ptr);
+  h->size = size;
+  h->offset = offset;
+  h->canary = HEAD_CANARY;
+  uint64_t tail = TAIL_CANARY;
+  memcpy(ptr + size, &tail, sizeof(tail));
+  memset(ptr, ALLOC_FILL, size);
+  return ptr;
+}
+
+// Returns the block of ptr, handed out by debug_arm(), after checking its
+// canaries; aborts if anything is wrong. what names the caller.
+static block* debug_block(void* ptr, const char* what) {
+  if((uintptr_t)ptr % ALIGNMENT != 0) debug_fail(what, "invalid pointer", ptr);
+  debug_head* h = debug_head_of(ptr);
+  // offsets are ALIGNMENT or an alignment asked for, see debug_memalign()
+  if(h->offset < ALIGNMENT || (h->offset & (h->offset - 1)) != 0 || h->offset > (uintptr_t)ptr) {
+    debug_fail(what, "invalid pointer", ptr);
+  }
+  block* pb = find_block((uint8_t*)ptr - h->offset);
+  if(pb == NULL || is_free(pb)) debug_fail(what, "invalid pointer", ptr);
+  if(h->canary == FREED_CANARY) debug_fail(what, "double free", ptr);
+  if(h->canary != HEAD_CANARY) debug_fail(what, "header overwritten", ptr);
+  if(h->size > block_data_size(pb) - h->offset - sizeof(uint64_t)) {
+    debug_fail(what, "header overwritten", ptr);
+  }
+  uint64_t tail;
+  memcpy(&tail, (uint8_t*)ptr + h->size, sizeof(tail));
+  if(tail != TAIL_CANARY) debug_fail(what, "buffer overflow", ptr);
+  return pb;
+}
+
+// Really frees the block of ptr, leaving the quarantine, after checking that
+// its data still holds FREE_FILL.
+static void debug_release(uint8_t* ptr) {
+  debug_head* h = debug_head_of(ptr);
+  for(size_t i = 0; i < h->size; i++) {
+    if(ptr[i] != FREE_FILL) debug_fail("free", "write after free", ptr + i);
+  }
+  free_block(data_to_block(ptr - h->offset));
+}
+
+static void* debug_malloc(size_t size) {
+  if(size > MAX_REQUEST - ALIGNMENT - sizeof(uint64_t)) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  return debug_arm(alloc_block(size + ALIGNMENT + sizeof(uint64_t), NULL), ALIGNMENT, size);
+}
+
+// data aligned to alignment, a power of two above ALIGNMENT: that is where
+// the heap puts the start of the data, and the head needs room before it
+static void* debug_memalign(size_t alignment, size_t size) {
+  if(alignment > UINT32_MAX / 2) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  return debug_arm(alloc_aligned_block(alignment, size + alignment + sizeof(uint64_t)), alignment, size);
+}
+
+static void debug_free(void* ptr) {
+  if(ptr == NULL) return;
+  debug_block(ptr, "free");
+  debug_head* h = debug_head_of(ptr);
+  h->canary = FREED_CANARY;
+  memset(ptr, FREE_FILL, h->size);
+
+  // let the oldest blocks go, until this one fits
+  void* leaving[QUARANTINE_SLOTS];
+  unsigned n = 0;
+  LOCK(main_arena);
+  while(quarantine.count > 0 && (quarantine.count == QUARANTINE_SLOTS ||
+                                 quarantine.bytes + h->size > QUARANTINE_BYTES)) {
+    void* old = quarantine.slots[quarantine.start];
+    quarantine.start = (quarantine.start + 1) % QUARANTINE_SLOTS;
+    quarantine.count--;
+    quarantine.bytes -= debug_head_of(old)->size;
+    leaving[n++] = old;
   }
+  quarantine.slots[(quarantine.start + quarantine.count) % QUARANTINE_SLOTS] = ptr;
+  quarantine.count++;
+  quarantine.bytes += h->size;
+  UNLOCK(main_arena);
+  for(unsigned i = 0; i < n; i++) debug_release(leaving[i]);
+}
 
-  return total_block_size;
+// always moves the data, so that stale pointers to the old block show up
+static void* debug_realloc(void* ptr, size_t size) {
+  if(ptr == NULL) return debug_malloc(size);
+  if(size == 0) {
+    debug_free(ptr);
+    return NULL;
+  }
+  debug_block(ptr, "realloc");
+  size_t old_size = debug_head_of(ptr)->size;
+  void* moved = debug_malloc(size);
+  if(moved == NULL) return NULL;
+  memcpy(moved, ptr, old_size < size ? old_size : size);
+  debug_free(ptr);
+  return moved;
 }
+/* end of Debug mode */
+#endif
 
+/* ------ Your assignment starts HERE! ------- */
 
 // Specification taken from man pages for each function.
 /*
@@ -208,42 +2004,17 @@ size_t total_size_deallocate(block* starting) {
        undefined behavior occurs.  If ptr is NULL, no operation is
        performed.
 */
-void free(void* ptr) {
-  /* TODO: Implement this */
-
-  if(ptr == ((void*) 1)){
-    return;
-  }
-
+MM_EXPORT void free(void* ptr) {
+#ifdef MM_DEBUG
+  debug_free(ptr);
+  return;
+#endif
+  if(ptr == NULL) return;
 
   // freeing memory can only be done if the ptr points to a valid address
-  if(ptr) {
-    if(!first->next) return;
-    fprintf(stderr, "First has a next\n");
-    block* found_block_free = find_block(ptr);
-    
-    
-    if(found_block_free){
-      //merge_blocks(found_block_free);
-      void* last_addr = sbrk(0);
-
-      //size_t total_block_size = block_total_size(found_block_free);
-      found_block_free->is_free = true;
-      //sbrk(-total_block_size);
-      //found_block->next = sbrk(0);
-    } else return;
-  }
-}
-
-// finds a block of the given size given the provided starting block
-block* find_free_block(block* starting, size_t given_size){
-  while(starting != NULL){
-    if(starting->is_free && block_total_size(starting) >= given_size){
-      return starting;
-    }
-    starting = starting->next;
-  }
-  return NULL;
+  block* found_block_free = find_block(ptr);
+  if(found_block_free == NULL || is_free(found_block_free)) return;
+  free_block(found_block_free);
 }
 
 /*
@@ -253,40 +2024,11 @@ block* find_free_block(block* starting, size_t given_size){
        be successfully passed to free().
 */
 
-void* malloc(size_t size) {
-  // TODO: Implement this
-
-  // standard check if you want to actually allocate memory
-  if(size == 0) return (void*) 1;
-
-  if(!first){
-    first = new_block(size);
-    fprintf(stderr, "Allocating FIRST block of size %d\n", block_total_size(first));
-    return block_to_data(first);
-  }
-
-  // first check if there is a free block of exactly the size we want
-  // ERROR FIX and then Lab 5 DONE
-  
-  for(block* start = first; start != sbrk(0); start=start->next){
-    //fprintf(stderr, "Going through blocks; this one has size %d\n", block_total_size(start));
-    if(block_total_size(start) == size && start->is_free){
-      fprintf(stderr, "Returning block of size %d\n", start);
-      return block_to_data(start);
-    } else if(block_total_size(start) > size && start->is_free){
-      fprintf(stderr, "The block used to have size %d\n", block_total_size(start));
-      split_block(start, size);
-      //fprintf(stderr, "Now the block is split and has size %d\n", block_total_size(start));
-      return block_to_data(start);
-    } else {
-      // tough luck: need to allocate a new block
-      block* new_blocks = new_block(size);
-      fprintf(stderr, "Allocating block of size %d\n", block_total_size(new_blocks));
-
-      return block_to_data(new_blocks);
-    }
-  }
-  return block_to_data(first);
+MM_EXPORT void* malloc(size_t size) {
+#ifdef MM_DEBUG
+  return debug_malloc(size);
+#endif
+  return block_to_data(alloc_block(size, NULL));
 }
 
 
@@ -306,7 +2048,7 @@ void* malloc(size_t size) {
            malloc(nmemb * size);
 */
 /* TO DO: Add proper tests in the framework */
-void* calloc(size_t nitems, size_t item_size) {
+MM_EXPORT void* calloc(size_t nitems, size_t item_size) {
 //  fprintf(stderr, "Try calloc %d, %d\n", nitems, item_size);
   size_t size = 0;
   if (__builtin_umull_overflow(nitems, item_size, &size)) {
@@ -314,8 +2056,18 @@ void* calloc(size_t nitems, size_t item_size) {
     errno = ENOMEM;
     return NULL;
   }
-  void* ptr = malloc(size);
-  if(ptr != NULL) memset(ptr, 0, size);
+  // memory fresh from the system is zero already: only clear up to it
+  uint8_t* zero = NULL;
+#ifdef MM_DEBUG
+  // debug blocks are filled, and sit between canaries
+  uint8_t* ptr = malloc(size);
+#else
+  uint8_t* ptr = block_to_data(alloc_block(size, &zero));
+#endif
+  if(ptr == NULL) return NULL;
+  size_t dirty = size;
+  if(zero != NULL && zero < ptr + size) dirty = zero > ptr ? (size_t)(zero - ptr) : 0;
+  memset(ptr, 0, dirty);
   return ptr;
 }
 
@@ -337,73 +2089,448 @@ void* calloc(size_t nitems, size_t item_size) {
        to malloc or related functions.  If the area pointed to was
        moved, a free(ptr) is done.
 */
-void* realloc(void* ptr, size_t size) {
-  /* TODO: Implement this */
-
+MM_EXPORT void* realloc(void* ptr, size_t size) {
+#ifdef MM_DEBUG
+  return debug_realloc(ptr, size);
+#endif
   if(!ptr) {
-    fprintf(stderr, "Just standard malloc here\n");
     return malloc(size);
-  } else if(ptr && !size) {
+  } else if(!size) {
     free(ptr);
-    fprintf(stderr, "There was a pointer but no size\n");
     return NULL;
-  } else {
+  }
+  // too big for a block, and request_size() would overflow
+  if(size > MAX_REQUEST) {
+    errno = ENOMEM;
+    return NULL;
+  }
 
   block* found_block = find_block(ptr);
-  if(!found_block) {
-    fprintf(stderr, "No block found\n");
+  if(!found_block || is_free(found_block)) {
     return NULL;
-    }
+  }
 
+  // first try to shrink or grow the block where it is; a big mapped block
+  // stays mapped, a mapped block shrinking below the threshold moves to
+  // the heap
   size_t size_block = block_data_size(found_block);
+  if(is_mapped(found_block)) {
+    if(size >= MMAP_THRESHOLD) return block_to_data(remap_block(found_block, size));
+  } else {
+    arena* a = block_arena(found_block);
+    LOCK(a);
+    bool resized = heap_resize(a, found_block, size);
+    UNLOCK(a);
+    if(resized) return ptr;
+  }
 
-  if(size_block >= size) {
-    
-    /* size_t curr_size;
-    block* block_free_start;
-    for(block* start = found_block; start != NULL; start=start->next){
-      curr_size += block_total_size(start);
+  // Current block size is small, we need to allocate more space. MAKE SURE TO PRESERVE ORIGINAL SPACE
+  void* newPtr = malloc(size);
+  if(newPtr == NULL) return NULL;
+  memcpy(newPtr, ptr, size_block < size ? size_block : size);
+  free(ptr);
+  return newPtr;
+}
 
-      if(curr_size == size){
-        block_free_start = start;
-        break;
-      }
+/*
+       The obsolete function memalign() allocates size bytes and returns
+       a pointer to the allocated memory.  The memory address will be a
+       multiple of alignment, which must be a power of two.
+*/
+MM_EXPORT void* memalign(size_t alignment, size_t size) {
+  if(alignment == 0 || (alignment & (alignment - 1)) != 0) {
+    errno = EINVAL;
+    return NULL;
+  }
+  if(alignment <= ALIGNMENT) return malloc(size);
+  if(alignment > MAX_REQUEST / 4 || size > MAX_REQUEST - 2 * alignment) {
+    errno = ENOMEM;
+    return NULL;
+  }
+#ifdef MM_DEBUG
+  return debug_memalign(alignment, size);
+#endif
+  return block_to_data(alloc_aligned_block(alignment, size));
+}
+
+/*
+       The function posix_memalign() allocates size bytes and places the
+       address of the allocated memory in *memptr.  The address of the
+       allocated memory will be a multiple of alignment, which must be a
+       power of two and a multiple of sizeof(void *).  This address can
+       later be successfully passed to free().  If size is 0, then the
+       value placed in *memptr is either NULL or a unique pointer value.
+
+       posix_memalign() returns zero on success, or one of the error
+       values EINVAL or ENOMEM on failure.  The value of errno is not set.
+*/
+MM_EXPORT int posix_memalign(void** memptr, size_t alignment, size_t size) {
+  if(alignment == 0 || alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0) {
+    return EINVAL;
+  }
+  int saved = errno;
+  void* ptr = memalign(alignment, size);
+  errno = saved;
+  if(ptr == NULL) return ENOMEM;
+  *memptr = ptr;
+  return 0;
+}
+
+/*
+       The function aligned_alloc() is the same as memalign(), except for
+       the added restriction that alignment must be a power of two.
+*/
+MM_EXPORT void* aligned_alloc(size_t alignment, size_t size) {
+  return memalign(alignment, size);
+}
+
+/*
+       The obsolete function valloc() allocates size bytes and returns a
+       pointer to the allocated memory.  The memory address will be a
+       multiple of the page size.
+*/
+MM_EXPORT void* valloc(size_t size) {
+  return memalign(page_size(), size);
+}
+
+/*
+       The malloc_usable_size() function returns the number of usable
+       bytes in the block pointed to by ptr, a pointer to a block of
+       memory allocated by malloc(3) or a related function.  If ptr is
+       NULL, 0 is returned.
+*/
+MM_EXPORT size_t malloc_usable_size(void* ptr) {
+#ifdef MM_DEBUG
+  if(ptr == NULL) return 0;
+  debug_block(ptr, "malloc_usable_size");
+  return debug_head_of(ptr)->size;
+#endif
+  if(ptr == NULL) return 0;
+  block* pb = find_block(ptr);
+  if(pb == NULL || is_free(pb)) return 0;
+  return block_data_size(pb);
+}
+
+/* ------ Batched frees ------- */
+/*
+  free_batch() gives back many blocks at once. The blocks are collected in a
+  buffer of FREE_BATCH and sorted by address, which sorts out repeats. The
+  mapped ones are then unmapped, and every run of heap blocks next to each
+  other is joined into one block before it is freed. Tearing down a
+  big structure, whose nodes were mostly allocated one after the other, so
+  takes one free per run instead of one per node.
+ */
+
+#define FREE_BATCH (256)
+
+// Sorts the n blocks in b by address and drops duplicates; returns how many
+// are left. A shell sort, as it works in place without the heap.
+static size_t sort_blocks(block** b, size_t n) {
+  static const size_t gaps[] = {109, 41, 19, 5, 1};
+  for (unsigned g = 0; g < sizeof(gaps) / sizeof(gaps[0]); g++) {
+    size_t gap = gaps[g];
+    for (size_t i = gap; i < n; i++) {
+      block* pb = b[i];
+      size_t j = i;
+      for (; j >= gap && b[j - gap] > pb; j -= gap) b[j] = b[j - gap];
+      b[j] = pb;
     }
+  }
+  size_t m = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (m == 0 || b[i] != b[m - 1]) b[m++] = b[i];
+  }
+  return m;
+}
 
-    void* start_free = block_to_data(block_free_start);
-    free(start_free);
-    fprintf(stderr, "We have freed some storage\n");
-    return start_free; */
-
-    // Current block size is too big, we need to free up space
-    // if the size of the block is too big, we need to split in order to maintain size reqs in realloc
-    ssize_t rest = split_block(found_block, size);
-    return ptr;
-  } 
-    
-    
-    /* block* new_blocks = malloc(size - size_block);
-    found_block->is_free = false;
-    found_block->next = new_blocks;
-    fprintf(stderr, "We have added some blocks. Size is now %d\n", block_total_size(found_block));
-    return block_to_data(found_block); */
-
-    // if there is additional blocks to merge when shrinking the found block pointer, shrink the given block and merge them together
-    // then return the shrinken pointer. This is determined by ensuring that two blocks together don't go oversize
-    block* nextBlock = found_block->next;
-    if(nextBlock != sbrk(0) && nextBlock->is_free && block_total_size(found_block) + block_total_size(nextBlock) >= size + META_SIZE){
-      ssize_t rest = split_block(found_block, size);
-      merge_blocks(found_block);
-      return ptr;
+// Frees the n occupied blocks in b, joining neighbours in the heap first.
+// Holds the lock of an arena for as long as its blocks follow each other in
+// b.
+static void free_sorted(block** b, size_t n) {
+  n = sort_blocks(b, n);
+  // with the repeats gone, the mapped blocks can be given back
+  size_t heap = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (is_mapped(b[i])) unmap_block(b[i]);
+    else b[heap++] = b[i];
+  }
+  n = heap;
+  arena* locked = NULL;
+  for (size_t i = 0; i < n; ) {
+    block* pb = b[i];
+    arena* a = block_arena(pb);
+    if (a != locked) {
+      if (locked != NULL) UNLOCK(locked);
+      LOCK(a);
+      locked = a;
     }
+    // take in the blocks right after pb that are freed as well
+    size_t total = block_total_size(pb);
+    for (i++; i < n && (uint8_t*)b[i] == (uint8_t*)pb + total && block_arena(b[i]) == a; i++) {
+      total += block_total_size(b[i]);
+      if (a->rover == b[i]) a->rover = pb;
+      if (a->last == b[i]) a->last = pb;
+      b[i]->head = 0; // no longer a block
+      a->stats.blocks--;
+      a->stats.merges++;
+    }
+    set_size(pb, total);
+    heap_free(a, pb);
+  }
+  if (locked != NULL) UNLOCK(locked);
+}
 
-    // Current block size is small, we need to allocate more space. MAKE SURE TO PRESERVE ORIGINAL SPACE
-    fprintf(stderr, "Need to allocate more blocks. Size is now %d\n", size_block);
-    void* newPtr = malloc(size);
-    memcpy(newPtr, ptr, size_block);
-    free(ptr);
-    return newPtr;
+#ifdef MM_DEBUG
+// free_batch() of the debug build, which skips repeated pointers as well,
+// instead of taking them for double frees: frees a sorted copy of ptrs
+// without them, or if there is no memory for that, checks each pointer
+// against the ones before it.
+static void debug_free_batch(void** ptrs, size_t n) {
+  if (n == 0) return;
+  size_t len = n * sizeof(block*);
+  block** sorted = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (sorted == MAP_FAILED) {
+    for (size_t i = 0; i < n; i++) {
+      size_t j = 0;
+      while (j < i && ptrs[j] != ptrs[i]) j++;
+      if (j == i) debug_free(ptrs[i]);
+    }
+    return;
   }
+  // sort_blocks() only compares addresses, so it sorts data pointers too
+  memcpy(sorted, ptrs, len);
+  size_t m = sort_blocks(sorted, n);
+  for (size_t i = 0; i < m; i++) debug_free(sorted[i]);
+  munmap(sorted, len);
+}
+#endif
 
-  return NULL;
+// Frees the n blocks in ptrs, like free() on each of them in turn. NULL,
+// bad and repeated pointers are skipped.
+MM_EXPORT void free_batch(void** ptrs, size_t n) {
+#ifdef MM_DEBUG
+  debug_free_batch(ptrs, n);
+  return;
+#endif
+  block* batch[FREE_BATCH];
+  size_t count = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (ptrs[i] == NULL) continue;
+    block* pb = find_block(ptrs[i]);
+    if (pb == NULL || is_free(pb)) continue;
+#ifdef MM_THREADS
+    if (tcache_holds(pb)) continue;
+#endif
+    batch[count++] = pb;
+    if (count == FREE_BATCH) {
+      free_sorted(batch, count);
+      count = 0;
+    }
+  }
+  free_sorted(batch, count);
+}
+
+/* ------ Slabs and arenas ------- */
+/*
+  Object pools on top of malloc(). A slab cache hands out objects of one size
+  from SLAB_SIZE slabs, each starting with a bitmap of its free objects, so
+  the objects need no header of their own. A bump arena hands out memory of
+  any size from big chunks, and frees all of it at once.
+  Neither is thread-safe: use one per thread, or lock around them.
+ */
+
+#define SLAB_SIZE (4096)
+// max objects in a slab, as many as there are bits in its bitmap
+#define SLAB_OBJECTS (SLAB_SIZE / ALIGNMENT)
+#define SLAB_MAP_WORDS (SLAB_OBJECTS / 32)
+// chunk size of a bump arena if none is given
+#define BUMP_CHUNK (64 * 1024)
+
+// Header at the start of every slab, the objects follow it.
+typedef struct slab_s {
+  struct slab_cache_s* cache; // the cache this slab belongs to
+  struct slab_s* prev; // neighbours in the partial or full list of the cache
+  struct slab_s* next;
+  unsigned used; // objects handed out
+  uint32_t free_map[SLAB_MAP_WORDS]; // a set bit for every free object
+} slab;
+
+typedef struct slab_cache_s {
+  size_t size; // size of an object
+  size_t start; // offset of the first object in a slab
+  unsigned count; // objects in a slab
+  slab* partial; // slabs with free objects
+  slab* full; // slabs without
+} slab_cache;
+
+typedef struct bump_chunk_s {
+  struct bump_chunk_s* next; // the chunk made before this one
+  size_t size; // of the data part, which follows
+} bump_chunk;
+
+typedef struct bump_arena_s {
+  size_t chunk_size;
+  bump_chunk* chunks; // newest first
+  uint8_t* top; // free part of the newest chunk
+  uint8_t* end;
+} bump_arena;
+
+static void slab_link(slab** list, slab* s) {
+  s->prev = NULL;
+  s->next = *list;
+  if (*list != NULL) (*list)->prev = s;
+  *list = s;
+}
+
+static void slab_unlink(slab** list, slab* s) {
+  if (s->prev != NULL) s->prev->next = s->next;
+  else *list = s->next;
+  if (s->next != NULL) s->next->prev = s->prev;
+}
+
+// Adds an empty slab to the partial list of cache c.
+static slab* slab_new(slab_cache* c) {
+  slab* s = memalign(SLAB_SIZE, SLAB_SIZE);
+  if (s == NULL) return NULL;
+  s->cache = c;
+  s->used = 0;
+  memset(s->free_map, 0, sizeof(s->free_map));
+  for (unsigned i = 0; i < c->count; i++) s->free_map[i / 32] |= 1u << (i % 32);
+  slab_link(&c->partial, s);
+  return s;
+}
+
+// Makes a cache of objects of size bytes. Returns NULL if that is too big
+// for more than one object per slab, use malloc() for those.
+MM_EXPORT slab_cache* slab_create(size_t size) {
+  size_t start = aligned_size(sizeof(slab));
+  size = aligned_size(size == 0 ? 1 : size);
+  if (size > (SLAB_SIZE - start) / 2) {
+    errno = EINVAL;
+    return NULL;
+  }
+  slab_cache* c = malloc(sizeof(slab_cache));
+  if (c == NULL) return NULL;
+  c->size = size;
+  c->start = start;
+  c->count = (SLAB_SIZE - start) / size;
+  if (c->count > SLAB_OBJECTS) c->count = SLAB_OBJECTS;
+  c->partial = NULL;
+  c->full = NULL;
+  return c;
+}
+
+// Takes an object from cache c, adding a slab to it if they are all used.
+MM_EXPORT void* slab_alloc(slab_cache* c) {
+  slab* s = c->partial;
+  if (s == NULL && (s = slab_new(c)) == NULL) return NULL;
+  unsigned w = 0;
+  while (s->free_map[w] == 0) w++;
+  unsigned i = w * 32 + __builtin_ctz(s->free_map[w]);
+  s->free_map[w] &= ~(1u << (i % 32));
+  if (++s->used == c->count) {
+    slab_unlink(&c->partial, s);
+    slab_link(&c->full, s);
+  }
+  return (uint8_t*)s + c->start + i * c->size;
+}
+
+// Gives object ptr back to cache c. A slab that becomes empty is freed,
+// unless it is the only one with free objects. Pointers that are not
+// objects of c and double frees are ignored.
+MM_EXPORT void slab_free(slab_cache* c, void* ptr) {
+  if (ptr == NULL) return;
+  slab* s = (slab*)((uintptr_t)ptr & ~(uintptr_t)(SLAB_SIZE - 1));
+  if (s->cache != c) return;
+  size_t offset = (uint8_t*)ptr - (uint8_t*)s - c->start;
+  unsigned i = offset / c->size;
+  if (offset % c->size != 0 || i >= c->count) return;
+  uint32_t bit = 1u << (i % 32);
+  if (s->free_map[i / 32] & bit) return;
+
+  s->free_map[i / 32] |= bit;
+  if (s->used-- == c->count) {
+    slab_unlink(&c->full, s);
+    slab_link(&c->partial, s);
+  }
+  if (s->used == 0 && (s->prev != NULL || s->next != NULL)) {
+    slab_unlink(&c->partial, s);
+    s->cache = NULL;
+    free(s);
+  }
+}
+
+// Frees cache c and all of its slabs, including the objects still in use.
+MM_EXPORT void slab_destroy(slab_cache* c) {
+  slab* lists[] = {c->partial, c->full};
+  for (unsigned l = 0; l < 2; l++) {
+    for (slab* s = lists[l]; s != NULL; ) {
+      slab* next = s->next;
+      s->cache = NULL;
+      free(s);
+      s = next;
+    }
+  }
+  free(c);
+}
+
+// Makes an arena taking memory from chunks of chunk_size bytes (BUMP_CHUNK
+// if 0); bigger requests get a chunk of their own.
+MM_EXPORT bump_arena* bump_create(size_t chunk_size) {
+  bump_arena* a = malloc(sizeof(bump_arena));
+  if (a == NULL) return NULL;
+  a->chunk_size = chunk_size == 0 ? BUMP_CHUNK : aligned_size(chunk_size);
+  a->chunks = NULL;
+  a->top = NULL;
+  a->end = NULL;
+  return a;
+}
+
+// Takes size bytes from arena a. The memory stays until the arena is reset.
+MM_EXPORT void* bump_alloc(bump_arena* a, size_t size) {
+  if (size > MAX_REQUEST) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  size = aligned_size(size == 0 ? 1 : size);
+  if (size > (size_t)(a->end - a->top)) {
+    size_t n = size > a->chunk_size ? size : a->chunk_size;
+    bump_chunk* ch = malloc(aligned_size(sizeof(bump_chunk)) + n);
+    if (ch == NULL) return NULL;
+    ch->next = a->chunks;
+    ch->size = n;
+    a->chunks = ch;
+    a->top = (uint8_t*)ch + aligned_size(sizeof(bump_chunk));
+    a->end = a->top + n;
+  }
+  void* ptr = a->top;
+  a->top += size;
+  return ptr;
+}
+
+// Frees everything taken from arena a at once. One chunk of the usual size
+// is kept for what comes next.
+MM_EXPORT void bump_reset(bump_arena* a) {
+  bump_chunk* keep = NULL;
+  for (bump_chunk* ch = a->chunks; ch != NULL; ) {
+    bump_chunk* next = ch->next;
+    if (keep == NULL && ch->size == a->chunk_size) keep = ch;
+    else free(ch);
+    ch = next;
+  }
+  a->chunks = keep;
+  a->top = NULL;
+  a->end = NULL;
+  if (keep != NULL) {
+    keep->next = NULL;
+    a->top = (uint8_t*)keep + aligned_size(sizeof(bump_chunk));
+    a->end = a->top + keep->size;
+  }
+}
+
+// Frees arena a and everything taken from it.
+MM_EXPORT void bump_destroy(bump_arena* a) {
+  bump_reset(a);
+  free(a->chunks);
+  free(a);
 }
@@ -126,6 +126,23 @@ pub fn build(b: *std.Build) void {
     // running the unit tests.
     const test_step = b.step("test", "Run unit tests");
     test_step.dependOn(&run_unit_tests.step);
+
+    // The hardened build of the allocator (-DMM_DEBUG), linked in as C so
+    // that its checks can be made to abort a child process.
+    const debug_tests = b.addTest(.{
+        .root_source_file = .{ .path = "src/debug.zig" },
+        .target = target,
+        .optimize = .Debug,
+    });
+
+    debug_tests.linkLibC();
+    debug_tests.addCSourceFile(.{
+        .file = .{ .path = "../ll-mm.c" },
+        .flags = &.{ "-std=c11", "-DMM_DEBUG", "-fno-sanitize=undefined" },
+    });
+
+    const run_debug_tests = b.addRunArtifact(debug_tests);
+    test_step.dependOn(&run_debug_tests.step);
 }
 
 fn setupGawk(self: *std.build.Step, progress: *std.Progress.Node) !void {
@@ -0,0 +1,116 @@
+const std = @import("std");
+
+// Tests of the hardened build: ll-mm.c is compiled with -DMM_DEBUG and
+// linked in, see build.zig, so that std.c.malloc() and friends are ours.
+// Every test corrupts the heap in a child process and checks that the
+// allocator catches it, names the problem and aborts.
+const c = std.c;
+const os = std.os;
+
+const expect = std.testing.expect;
+const expectEq = std.testing.expectEqual;
+
+extern fn free_batch(ptrs: [*]?*anyopaque, n: usize) void;
+
+// must match QUARANTINE_BYTES in ll-mm.c
+const quarantine_bytes = 1024 * 1024;
+
+// Runs f in a child process, and checks that it aborts with a message on
+// stderr containing problem.
+fn expectAbort(comptime f: fn () void, problem: []const u8) !void {
+    const fds = try os.pipe();
+    const pid = try os.fork();
+    if (pid == 0) {
+        os.dup2(fds[1], os.STDERR_FILENO) catch os.exit(1);
+        f();
+        os.exit(0);
+    }
+    os.close(fds[1]);
+    defer os.close(fds[0]);
+    var buf: [256]u8 = undefined;
+    var n: usize = 0;
+    while (n < buf.len) {
+        const got = try os.read(fds[0], buf[n..]);
+        if (got == 0) break;
+        n += got;
+    }
+    const res = os.waitpid(pid, 0);
+    try expect(os.W.IFSIGNALED(res.status));
+    try expectEq(@as(u32, os.SIG.ABRT), os.W.TERMSIG(res.status));
+    if (std.mem.indexOf(u8, buf[0..n], problem) == null) {
+        std.debug.print("Expected \"{s}\", got \"{s}\".\n", .{ problem, buf[0..n] });
+        return error.TestUnexpectedError;
+    }
+}
+
+fn overflow() void {
+    const p: [*]u8 = @ptrCast(c.malloc(24).?);
+    p[24] = 0;
+    c.free(p);
+}
+
+fn doubleFree() void {
+    const p = c.malloc(24);
+    c.free(p);
+    c.free(p);
+}
+
+fn writeAfterFree() void {
+    const p: [*]u8 = @ptrCast(c.malloc(24).?);
+    c.free(p);
+    p[0] = 1;
+    // pushes p out of the quarantine, which checks it
+    c.free(c.malloc(quarantine_bytes));
+}
+
+fn untouched() void {
+    const p: [*]u8 = @ptrCast(c.malloc(24).?);
+    @memset(p[0..24], 1);
+    c.free(p);
+    c.free(c.malloc(quarantine_bytes));
+}
+
+fn batchWithRepeats() void {
+    const p = c.malloc(24);
+    const q = c.malloc(200000);
+    var batch = [_]?*anyopaque{ p, q, null, p, q };
+    free_batch(&batch, batch.len);
+}
+
+// Writing past the end of a block overwrites its tail canary.
+test "debug: overwritten canary aborts" {
+    try expectAbort(overflow, "buffer overflow");
+}
+
+// A freed block stays in the quarantine, marked as freed.
+test "debug: double free aborts" {
+    try expectAbort(doubleFree, "double free");
+}
+
+// The data of a freed block must still be poisoned when it leaves the
+// quarantine.
+test "debug: write after free aborts" {
+    try expectAbort(writeAfterFree, "write after free");
+}
+
+// Runs f in a child process, and checks that it exits normally.
+fn expectPass(comptime f: fn () void) !void {
+    const pid = try os.fork();
+    if (pid == 0) {
+        f();
+        os.exit(0);
+    }
+    const res = os.waitpid(pid, 0);
+    try expect(os.W.IFEXITED(res.status));
+    try expectEq(@as(u8, 0), os.W.EXITSTATUS(res.status));
+}
+
+// A block used as it should be goes through the quarantine unnoticed.
+test "debug: correct use passes" {
+    try expectPass(untouched);
+}
+
+// free_batch() skips repeated pointers, as in the normal build.
+test "debug: free_batch skips repeats" {
+    try expectPass(batchWithRepeats);
+}
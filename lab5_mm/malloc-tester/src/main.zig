@@ -113,11 +113,16 @@ test "malloc in gap" {
 
 test "malloc 0 bytes" {
     defer own.reset();
-    // test for corner cases
+    // test for corner cases: a real block, unique and growing in place
     const aptr = own.malloc(0);
     try expectNotNull(aptr);
+    const bptr = own.malloc(0);
+    try expect(aptr != bptr);
+    own.free(bptr);
+    const grown = own.realloc(aptr, 20);
+    try expectEq(aptr, grown);
+    own.free(grown);
     try expectEq(@as(usize,0), own.used_size());
-    own.free(aptr);
 }
 
 test "realloc NULL and 0 bytes" {
@@ -128,6 +133,8 @@ test "realloc NULL and 0 bytes" {
     try expectNotNull(aptr2);
     try expectGE(own.used_size(), 100); // could be > because of alignment
     _ = own.realloc(aptr2, 0); // same as free aptr2
+    try expectEq(own.malloc_usable_size(aptr1), own.used_size());
+    own.free(aptr1);
     try expectEq(@as(usize,0), own.used_size());
 }
 
@@ -200,13 +207,35 @@ test "malloc test non-aligned" {
     own.free(b);
 }
 
-// TODO: add some tests for calloc here
-// test "calloc test 1" {
-//
-// }
-// test "calloc test 2" {
-//
-// }
+test "calloc clears reused memory" {
+    defer own.reset();
+    const p = own.malloc(3000);
+    const guard = own.malloc(16);
+    _ = c.memset(p, 0xab, 3000);
+    own.free(p);
+    // gets the same block back, with the old contents
+    const q = own.calloc(30, 100);
+    try expectEq(p, q);
+    for (@as([*]u8, @ptrCast(q))[0..3000]) |b| try expectEq(@as(u8, 0), b);
+    own.free(q);
+    own.free(guard);
+}
+
+test "calloc of fresh memory is zero" {
+    defer own.reset();
+    // blocks the heap grows for
+    const p = own.calloc(1, 5000);
+    const q = own.calloc(1000, 5);
+    for (@as([*]u8, @ptrCast(p))[0..5000]) |b| try expectEq(@as(u8, 0), b);
+    for (@as([*]u8, @ptrCast(q))[0..5000]) |b| try expectEq(@as(u8, 0), b);
+    // and a mapped block
+    const m = own.calloc(1 << 20, 1);
+    for (@as([*]u8, @ptrCast(m))[0 .. 1 << 20]) |b| try expectEq(@as(u8, 0), b);
+    own.free(m);
+    own.free(q);
+    own.free(p);
+    try expect(own.calloc(1 << 62, 8) == null);
+}
 
 test "realloc shrink test" {
     defer own.reset();
@@ -303,6 +332,337 @@ test "realloc middle grow data test" {
     try expectEq(@as(usize,0), own.used_size());
 }
 
+// Freed blocks are kept in per size class free lists, so a new request of the
+// same size is served from the list instead of growing the heap.
+test "malloc reuses freed block" {
+    defer own.reset();
+    const aptr1 = own.malloc(100);
+    try expectNotNull(aptr1);
+    const aptr2 = own.malloc(100);
+    try expectNotNull(aptr2);
+    own.free(aptr1);
+    const aptr3 = own.malloc(100);
+    try expectEq(aptr1, aptr3);
+    own.free(aptr2);
+    own.free(aptr3);
+    try expectEq(@as(usize,0), own.used_size());
+}
+
+// Freeing a block merges it with free neighbours on both sides, so the
+// space of three adjacent freed blocks can be reused for one larger block.
+test "free merges neighbours" {
+    defer own.reset();
+    const aptr1 = own.malloc(100);
+    const aptr2 = own.malloc(100);
+    const aptr3 = own.malloc(100);
+    const guard = own.malloc(100);
+    try expectNotNull(guard);
+    own.free(aptr1);
+    own.free(aptr3);
+    own.free(aptr2); // merges with both aptr1 and aptr3
+    const big = own.malloc(300);
+    try expectEq(aptr1, big);
+    own.free(big);
+    own.free(guard);
+    try expectEq(@as(usize,0), own.used_size());
+}
+
+// Pointers that were not returned by malloc, or were already freed, are
+// recognized by free and ignored.
+test "free ignores bad and double frees" {
+    defer own.reset();
+    const aptr1 = own.malloc(100);
+    try expectNotNull(aptr1);
+    const inner = @as([*]u8, @ptrCast(aptr1)) + 16;
+    own.free(inner);
+    try expectGE(own.used_size(), 100);
+    own.free(aptr1);
+    own.free(aptr1);
+    try expectEq(@as(usize,0), own.used_size());
+}
+
+// A freed big block has been unmapped, but is still ignored like any other.
+test "free ignores double frees of big blocks" {
+    defer own.reset();
+    const big = own.malloc(200000);
+    try expectNotNull(big);
+    own.free(big);
+    own.free(big);
+    try expect(own.realloc(big, 100) == null);
+    try expectEq(@as(usize, 0), own.malloc_usable_size(big));
+    try expectEq(@as(usize,0), own.used_size());
+}
+
+// Big blocks get a mapping of their own, so they neither grow the heap nor
+// keep it from shrinking once they are freed.
+test "big malloc does not grow the heap" {
+    defer own.reset();
+    const before = own.sbrk(0);
+    const big = own.malloc(1024 * 1024);
+    try expectNotNull(big);
+    try expectEq(before, own.sbrk(0));
+    try expectGE(own.used_size(), 1024 * 1024);
+    own.free(big);
+    try expectEq(@as(usize,0), own.used_size());
+}
+
+// Growing the last block of the heap, or a block followed by a free one,
+// happens in place without moving the data.
+test "realloc grows in place" {
+    defer own.reset();
+    const r = own.malloc(100);
+    try expectNotNull(r);
+    var n: usize = 200;
+    while (n < 100000) : (n *= 2) {
+        try expectEq(r, own.realloc(r, n));
+    }
+    const q = own.malloc(100);
+    const guard = own.malloc(100);
+    own.free(own.malloc(100)); // keeps a free block after guard
+    own.free(guard);
+    try expectEq(q, own.realloc(q, 200));
+    own.free(q);
+    own.free(r);
+    try expectEq(@as(usize,0), own.used_size());
+}
+
+// A block header takes one word, so a 24 byte block fits in 32 bytes.
+test "small blocks have a one word header" {
+    defer own.reset();
+    const a = own.malloc(24);
+    const b = own.malloc(24);
+    try expectNotNull(a);
+    try expectNotNull(b);
+    try expectEq(@as(usize, 32), @intFromPtr(b.?) - @intFromPtr(a.?));
+    own.free(a);
+    own.free(b);
+    try expectEq(@as(usize,0), own.used_size());
+}
+
+// A size no block can hold fails, and leaves the block as it was.
+test "realloc to a huge size fails" {
+    defer own.reset();
+    const p = own.malloc(100);
+    try expectNotNull(p);
+    const size = own.malloc_usable_size(p);
+    try expect(own.realloc(p, std.math.maxInt(usize) - 4) == null);
+    try expectEq(size, own.malloc_usable_size(p));
+    const big = own.malloc(1024 * 1024);
+    try expectNotNull(big);
+    try expect(own.realloc(big, std.math.maxInt(usize) - 4) == null);
+    try expectGE(own.malloc_usable_size(big), 1024 * 1024);
+    own.free(big);
+    own.free(p);
+    try expectEq(@as(usize,0), own.used_size());
+}
+
+// Aligned blocks are carved out of free blocks before the heap grows.
+test "memalign carves aligned blocks from free blocks" {
+    defer own.reset();
+    const a = own.malloc(10000);
+    const guard = own.malloc(16);
+    try expectNotNull(a);
+    own.free(a);
+    const before = own.sbrk(0);
+    const p = own.memalign(4096, 1000);
+    const q = own.memalign(64, 100);
+    try expectNotNull(p);
+    try expectNotNull(q);
+    try expectEq(@as(usize, 0), @intFromPtr(p.?) % 4096);
+    try expectEq(@as(usize, 0), @intFromPtr(q.?) % 64);
+    try expectEq(before, own.sbrk(0));
+    own.free(p);
+    own.free(q);
+    own.free(guard);
+    try expectEq(@as(usize,0), own.used_size());
+}
+
+// Zero bytes get a block with aligned data as well.
+test "memalign 0 bytes" {
+    defer own.reset();
+    const p = own.memalign(4096, 0);
+    try expectNotNull(p);
+    try expectEq(@as(usize, 0), @intFromPtr(p.?) % 4096);
+    var q: ?*anyopaque = null;
+    try expectEq(@as(c_int, 0), own.posix_memalign(&q, 64, 0));
+    try expectNotNull(q);
+    try expectEq(@as(usize, 0), @intFromPtr(q.?) % 64);
+    own.free(p);
+    own.free(q);
+    try expectEq(@as(usize,0), own.used_size());
+}
+
+// Once something else moved the break, aligned blocks get a mapping.
+test "memalign maps when the heap cannot grow" {
+    defer own.reset();
+    const guard = own.malloc(16);
+    try expectNotNull(guard);
+    _ = own.sbrk(4096);
+    const p = own.memalign(4096, 1000);
+    const q = own.memalign(64, 100);
+    try expectNotNull(p);
+    try expectNotNull(q);
+    try expectEq(@as(usize, 0), @intFromPtr(p.?) % 4096);
+    try expectEq(@as(usize, 0), @intFromPtr(q.?) % 64);
+    try expectGE(own.malloc_usable_size(p), 1000);
+    own.free(p);
+    own.free(q);
+    own.free(guard);
+    try expectEq(@as(usize,0), own.used_size());
+}
+
+// A page aligned pointer could be aligned data of a mapped block, whose
+// header is in the page before; one that is not ours is ignored without
+// looking there.
+test "free ignores foreign page aligned pointers" {
+    defer own.reset();
+    const m = try std.os.mmap(null, 2 * std.mem.page_size, std.os.PROT.READ | std.os.PROT.WRITE,
+        std.os.MAP.PRIVATE | std.os.MAP.ANONYMOUS, -1, 0);
+    std.os.munmap(m[0..std.mem.page_size]);
+    own.free(m.ptr + std.mem.page_size);
+    try expectEq(@as(usize, 0), own.malloc_usable_size(m.ptr + std.mem.page_size));
+    std.os.munmap(@alignCast(m[std.mem.page_size..]));
+}
+
+// Slab objects are packed without headers, arenas are freed all at once.
+test "slab caches and bump arenas" {
+    defer own.reset();
+    const cache = own.slab_create(32);
+    try expectNotNull(cache);
+    const a = own.slab_alloc(cache);
+    const b = own.slab_alloc(cache);
+    try expectNotNull(a);
+    try expectNotNull(b);
+    try expectEq(@as(usize, 32), @intFromPtr(b.?) - @intFromPtr(a.?));
+    own.slab_free(cache, a);
+    try expectEq(a, own.slab_alloc(cache));
+    own.slab_destroy(cache);
+    try expectEq(@as(usize,0), own.used_size());
+
+    const arena = own.bump_create(0);
+    try expectNotNull(arena);
+    var i: usize = 0;
+    while (i < 10000) : (i += 1) {
+        try expectNotNull(own.bump_alloc(arena, 100));
+    }
+    own.bump_reset(arena);
+    try expectGE(own.BUMP_CHUNK + 128, own.used_size());
+    own.bump_destroy(arena);
+    try expectEq(@as(usize,0), own.used_size());
+}
+
+// The statistics are kept up to date without walking the heap.
+test "statistics follow the heap" {
+    defer own.reset();
+    const a = own.malloc(100);
+    const b = own.malloc(100);
+    const guard = own.malloc(100);
+    own.free(b);
+    var st = own.get_stats();
+    try expectEq(@as(usize, 3), st.blocks);
+    try expectEq(@as(usize, 1), st.free_blocks);
+    try expectEq(own.unused_size(), st.free);
+    try expectEq(own.used_size(), st.in_use);
+    own.free(a);
+    st = own.get_stats();
+    try expectEq(@as(usize, 2), st.blocks);
+    try expectEq(@as(usize, 1), st.merges);
+    own.free(guard);
+    try expectEq(@as(usize,0), own.used_size());
+}
+
+// A snapshot lists the blocks of the heap in address order.
+test "dump_heap writes the blocks" {
+    defer own.reset();
+    const a = own.malloc(3000);
+    const b = own.malloc(3000);
+    own.free(a);
+    const fds = try std.os.pipe();
+    defer std.os.close(fds[0]);
+    own.dump_heap(fds[1]);
+    std.os.close(fds[1]);
+    var buf: [4096]u8 = undefined;
+    const n = try std.os.read(fds[0], &buf);
+    try expect(std.mem.indexOf(u8, buf[0..n], "\"blocks\":[[3008,1],[3008,0]]") != null);
+    try expect(buf[n - 1] == '\n');
+    own.free(b);
+}
+
+// Big free blocks are kept ordered by size, so the best fitting one is reused.
+test "big free blocks are reused best fit" {
+    defer own.reset();
+    const a = own.malloc(20000);
+    const g1 = own.malloc(16);
+    const b = own.malloc(12000);
+    const g2 = own.malloc(16);
+    const d = own.malloc(30000);
+    const g3 = own.malloc(16);
+    own.free(a);
+    own.free(b);
+    own.free(d);
+    const p = own.malloc(11000);
+    const q = own.malloc(19000);
+    try expectEq(b, p);
+    try expectEq(a, q);
+    own.free(p);
+    own.free(q);
+    own.free(g1);
+    own.free(g2);
+    own.free(g3);
+    try expectEq(@as(usize,0), own.used_size());
+}
+
+// A batch of neighbouring blocks is joined and freed as one block.
+test "free_batch joins neighbours" {
+    defer own.reset();
+    var ptrs: [64]?*anyopaque = undefined;
+    for (&ptrs) |*p| {
+        p.* = own.malloc(40);
+        try expectNotNull(p.*);
+    }
+    const guard = own.malloc(16);
+    const big = own.malloc(200000);
+    try expectNotNull(big);
+    // in reverse, with repeats and a NULL, which are skipped
+    var batch: [69]?*anyopaque = undefined;
+    for (ptrs, 0..) |p, i| batch[63 - i] = p;
+    batch[64] = ptrs[0];
+    batch[65] = null;
+    batch[66] = big;
+    batch[67] = ptrs[1];
+    batch[68] = big;
+    own.free_batch(&batch, batch.len);
+    const st = own.get_stats();
+    try expectEq(@as(usize, 2), st.blocks);
+    try expectEq(@as(usize, 1), st.free_blocks);
+    own.free(guard);
+    try expectEq(@as(usize,0), own.used_size());
+}
+
+// Free space at the top of the heap goes back to the system once it reaches
+// TRIM_THRESHOLD, all but TOP_PAD bytes of it.
+test "free trims the top of the heap" {
+    defer own.reset();
+    const guard = own.malloc(16);
+    try expectNotNull(guard);
+    const small = own.malloc(own.TRIM_THRESHOLD / 2);
+    const before = own.sbrk(0);
+    own.free(small);
+    try expectEq(before, own.sbrk(0));
+    var ptrs: [64]?*anyopaque = undefined;
+    for (&ptrs) |*p| {
+        p.* = own.malloc(8000);
+        try expectNotNull(p.*);
+    }
+    const top = @intFromPtr(own.sbrk(0));
+    for (ptrs) |p| own.free(p);
+    const trimmed = @intFromPtr(own.sbrk(0));
+    try expectGE(top - trimmed, ptrs.len * 8000 - own.TOP_PAD - std.mem.page_size);
+    try expectGE(trimmed - @intFromPtr(guard.?), own.TOP_PAD);
+    own.free(guard);
+    try expectEq(@as(usize,0), own.used_size());
+}
+
 // test "fail test" {
 //     return error.Fail;
 // }
@@ -166,19 +166,15 @@ static ssize_t split_block(block* pb, size_t size) {
   return rest;
 }
 
-// Merges all free adjacent blocks in the list, starting at block pb.
+// Merges the free block pb with the free blocks directly following it.
+// Stops at the first occupied block instead of scanning to the end of the
+// heap, so it costs as much as the number of blocks merged.
 // Note: does not check for valid input block
 static void merge_blocks(block* pb) {
   void* last_addr = sbrk(0);
-  if(pb == NULL || pb == last_addr) return;
-  while (pb->next != last_addr) { // while there is a next
-    block* pn = pb->next;
-    if (pb->is_free && pn->is_free) {
-      // can merge
-      pb->next = pn->next;
-    } else {
-      // move to next
-      pb = pn;
-    }
+  if(pb == NULL || pb == last_addr || !pb->is_free) return;
+  while (pb->next != last_addr && pb->next->is_free) { // while next is free
+    // can merge
+    pb->next = pb->next->next;
   }
 }
\ No newline at end of file